@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "decompressor.h"
+
+#include <string.h>
+
+#include <android-base/logging.h>
+#include <android/gsi/IGsiService.h>
+#include <lz4frame.h>
+#include <zlib.h>
+#include <zstd.h>
+
+namespace android {
+namespace gsi {
+
+// gzip streams, as produced by gzip(1). Concatenated members are accepted.
+class GzipDecompressor final : public Decompressor {
+  public:
+    ~GzipDecompressor() override {
+        if (initialized_) {
+            inflateEnd(&stream_);
+        }
+    }
+
+    bool Init() {
+        memset(&stream_, 0, sizeof(stream_));
+        // Adding 16 to the window bits selects the gzip wrapper.
+        int rv = inflateInit2(&stream_, 16 + MAX_WBITS);
+        if (rv != Z_OK) {
+            LOG(ERROR) << "inflateInit2 failed: " << rv;
+            return false;
+        }
+        initialized_ = true;
+        return true;
+    }
+
+    bool Decompress(const char** in, size_t* in_bytes, char* out, size_t out_capacity,
+                    size_t* out_length) override {
+        while (*out_length < out_capacity) {
+            if (member_done_) {
+                if (!*in_bytes) {
+                    break;
+                }
+                // Another member follows the one that just ended.
+                if (inflateReset(&stream_) != Z_OK) {
+                    LOG(ERROR) << "inflateReset failed";
+                    return false;
+                }
+                member_done_ = false;
+            }
+
+            stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(*in));
+            stream_.avail_in = *in_bytes;
+            stream_.next_out = reinterpret_cast<Bytef*>(out + *out_length);
+            stream_.avail_out = out_capacity - *out_length;
+
+            int rv = inflate(&stream_, Z_NO_FLUSH);
+            size_t consumed = *in_bytes - stream_.avail_in;
+            size_t produced = (out_capacity - stream_.avail_out) - *out_length;
+            *in += consumed;
+            *in_bytes -= consumed;
+            *out_length += produced;
+
+            if (rv == Z_STREAM_END) {
+                member_done_ = true;
+            } else if (rv == Z_BUF_ERROR || (rv == Z_OK && !consumed && !produced)) {
+                // Nothing more can be done without more input.
+                break;
+            } else if (rv != Z_OK) {
+                LOG(ERROR) << "inflate failed: " << rv << " " << (stream_.msg ? stream_.msg : "");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool finished() const override { return member_done_; }
+
+  private:
+    z_stream stream_;
+    bool initialized_ = false;
+    bool member_done_ = false;
+};
+
+// LZ4 frame format, as produced by lz4(1).
+class Lz4Decompressor final : public Decompressor {
+  public:
+    ~Lz4Decompressor() override {
+        if (context_) {
+            LZ4F_freeDecompressionContext(context_);
+        }
+    }
+
+    bool Init() {
+        size_t rv = LZ4F_createDecompressionContext(&context_, LZ4F_VERSION);
+        if (LZ4F_isError(rv)) {
+            LOG(ERROR) << "LZ4F_createDecompressionContext failed: " << LZ4F_getErrorName(rv);
+            return false;
+        }
+        return true;
+    }
+
+    bool Decompress(const char** in, size_t* in_bytes, char* out, size_t out_capacity,
+                    size_t* out_length) override {
+        // LZ4F buffers internally, so keep going while it makes progress.
+        while (*out_length < out_capacity) {
+            size_t src_size = *in_bytes;
+            size_t dst_size = out_capacity - *out_length;
+            size_t rv = LZ4F_decompress(context_, out + *out_length, &dst_size, *in, &src_size,
+                                        nullptr);
+            if (LZ4F_isError(rv)) {
+                LOG(ERROR) << "LZ4F_decompress failed: " << LZ4F_getErrorName(rv);
+                return false;
+            }
+            if (!src_size && !dst_size) {
+                break;
+            }
+            *in += src_size;
+            *in_bytes -= src_size;
+            *out_length += dst_size;
+            frame_done_ = (rv == 0);
+        }
+        return true;
+    }
+
+    bool finished() const override { return frame_done_; }
+
+  private:
+    LZ4F_dctx* context_ = nullptr;
+    bool frame_done_ = false;
+};
+
+// zstd frames, as produced by zstd(1).
+class ZstdDecompressor final : public Decompressor {
+  public:
+    ~ZstdDecompressor() override {
+        if (stream_) {
+            ZSTD_freeDStream(stream_);
+        }
+    }
+
+    bool Init() {
+        stream_ = ZSTD_createDStream();
+        if (!stream_) {
+            LOG(ERROR) << "ZSTD_createDStream failed";
+            return false;
+        }
+        size_t rv = ZSTD_initDStream(stream_);
+        if (ZSTD_isError(rv)) {
+            LOG(ERROR) << "ZSTD_initDStream failed: " << ZSTD_getErrorName(rv);
+            return false;
+        }
+        return true;
+    }
+
+    bool Decompress(const char** in, size_t* in_bytes, char* out, size_t out_capacity,
+                    size_t* out_length) override {
+        while (*out_length < out_capacity) {
+            ZSTD_inBuffer input = {*in, *in_bytes, 0};
+            ZSTD_outBuffer output = {out, out_capacity, *out_length};
+            size_t rv = ZSTD_decompressStream(stream_, &output, &input);
+            if (ZSTD_isError(rv)) {
+                LOG(ERROR) << "ZSTD_decompressStream failed: " << ZSTD_getErrorName(rv);
+                return false;
+            }
+            if (!input.pos && output.pos == *out_length) {
+                break;
+            }
+            *in += input.pos;
+            *in_bytes -= input.pos;
+            *out_length = output.pos;
+            frame_done_ = (rv == 0);
+        }
+        return true;
+    }
+
+    bool finished() const override { return frame_done_; }
+
+  private:
+    ZSTD_DStream* stream_ = nullptr;
+    bool frame_done_ = false;
+};
+
+std::unique_ptr<Decompressor> Decompressor::Create(int compression) {
+    switch (compression) {
+        case IGsiService::COMPRESSION_GZIP: {
+            auto decompressor = std::make_unique<GzipDecompressor>();
+            if (!decompressor->Init()) return nullptr;
+            return decompressor;
+        }
+        case IGsiService::COMPRESSION_LZ4: {
+            auto decompressor = std::make_unique<Lz4Decompressor>();
+            if (!decompressor->Init()) return nullptr;
+            return decompressor;
+        }
+        case IGsiService::COMPRESSION_ZSTD: {
+            auto decompressor = std::make_unique<ZstdDecompressor>();
+            if (!decompressor->Init()) return nullptr;
+            return decompressor;
+        }
+        default:
+            LOG(ERROR) << "unknown compression type " << compression;
+            return nullptr;
+    }
+}
+
+}  // namespace gsi
+}  // namespace android
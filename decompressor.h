@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+
+namespace android {
+namespace gsi {
+
+// Streaming decompressor for install streams. Input may be split at any
+// point, and output is produced into caller-supplied buffers.
+class Decompressor {
+  public:
+    // |compression| is one of the IGsiService::COMPRESSION_* constants other
+    // than COMPRESSION_NONE.
+    static std::unique_ptr<Decompressor> Create(int compression);
+
+    virtual ~Decompressor() {}
+
+    // Decompress from |*in|, which holds |*in_bytes|, appending to |out|,
+    // which holds |*out_length| of |out_capacity| bytes. The input and
+    // output positions are advanced. If the output fills up, some input may
+    // be left unconsumed, or decompressed data may be held back until the
+    // next call.
+    virtual bool Decompress(const char** in, size_t* in_bytes, char* out, size_t out_capacity,
+                            size_t* out_length) = 0;
+
+    // True if the data seen so far ends on a complete frame (or member).
+    virtual bool finished() const = 0;
+
+    Decompressor() = default;
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+};
+
+}  // namespace gsi
+}  // namespace android
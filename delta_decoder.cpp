@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "delta_decoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+#include "image_digest.h"
+
+namespace android {
+namespace gsi {
+
+static constexpr uint16_t kDeltaMajorVersion = 1;
+static constexpr size_t kOpHeaderSize = 24;
+static constexpr size_t kDigestSize = 32;
+static constexpr uint16_t kOpData = 1;
+static constexpr uint16_t kOpZero = 2;
+static constexpr uint16_t kOpCopy = 3;
+// The decoder keeps a bit per block, so tiny blocks would make it use a lot
+// of memory. Blocks are also the unit of the block manifest.
+static constexpr uint32_t kMinDeltaBlockSize = kManifestBlockSize;
+static constexpr uint32_t kMaxDeltaBlockSize = 16 * 1024 * 1024;
+
+template <typename T>
+static T Load(const uint8_t* data, size_t offset) {
+    T value;
+    memcpy(&value, data + offset, sizeof(value));
+    return value;
+}
+
+// An all-zero digest means the digest was not given.
+static std::string LoadDigest(const uint8_t* data, size_t offset) {
+    const uint8_t* digest = data + offset;
+    if (std::all_of(digest, digest + kDigestSize, [](uint8_t b) { return b == 0; })) {
+        return {};
+    }
+    return DigestToHex(digest, kDigestSize);
+}
+
+DeltaDecoder::DeltaDecoder(WriteFn&& write, ZeroFn&& zero, CopyFn&& copy)
+    : write_(std::move(write)), zero_(std::move(zero)), copy_(std::move(copy)) {}
+
+bool DeltaDecoder::ParseHeader(const void* data, size_t bytes, DeltaHeader* header) {
+    if (bytes < kDeltaHeaderSize) {
+        LOG(ERROR) << "delta header is too short: " << bytes;
+        return false;
+    }
+    auto pos = reinterpret_cast<const uint8_t*>(data);
+    if (Load<uint32_t>(pos, 0) != kDeltaMagic) {
+        LOG(ERROR) << "bad delta magic";
+        return false;
+    }
+    uint16_t major_version = Load<uint16_t>(pos, 4);
+    if (major_version != kDeltaMajorVersion) {
+        LOG(ERROR) << "unsupported delta version " << major_version;
+        return false;
+    }
+    if (Load<uint16_t>(pos, 6) < kDeltaHeaderSize) {
+        LOG(ERROR) << "bad delta header size: " << Load<uint16_t>(pos, 6);
+        return false;
+    }
+    header->block_size = Load<uint32_t>(pos, 8);
+    header->total_ops = Load<uint32_t>(pos, 12);
+    header->image_size = Load<uint64_t>(pos, 16);
+    header->source_digest = LoadDigest(pos, 24);
+    header->target_digest = LoadDigest(pos, 24 + kDigestSize);
+
+    if (header->block_size < kMinDeltaBlockSize || header->block_size > kMaxDeltaBlockSize ||
+        header->block_size % kMinDeltaBlockSize) {
+        LOG(ERROR) << "bad delta block size " << header->block_size;
+        return false;
+    }
+    if (header->image_size % header->block_size) {
+        LOG(ERROR) << "bad delta block size " << header->block_size << " for image size "
+                   << header->image_size;
+        return false;
+    }
+    return true;
+}
+
+size_t DeltaDecoder::Buffer(const uint8_t* data, size_t bytes, size_t size) {
+    size_t to_copy = std::min(bytes, size - header_.size());
+    header_.insert(header_.end(), data, data + to_copy);
+    return to_copy;
+}
+
+bool DeltaDecoder::Decode(const void* data, size_t bytes) {
+    auto pos = reinterpret_cast<const uint8_t*>(data);
+    while (bytes) {
+        size_t consumed = 0;
+        switch (state_) {
+            case State::kFileHeader:
+                consumed = Buffer(pos, bytes, kDeltaHeaderSize);
+                if (header_.size() == kDeltaHeaderSize && !ParseFileHeader()) {
+                    return false;
+                }
+                break;
+            case State::kSkipHeader:
+                consumed = std::min(static_cast<uint64_t>(bytes), remaining_);
+                remaining_ -= consumed;
+                if (!remaining_) {
+                    state_ = file_header_.total_ops ? State::kOpHeader : State::kDone;
+                }
+                break;
+            case State::kOpHeader:
+                consumed = Buffer(pos, bytes, kOpHeaderSize);
+                if (header_.size() == kOpHeaderSize && !ParseOpHeader()) {
+                    return false;
+                }
+                break;
+            case State::kOpData:
+                consumed = std::min(static_cast<uint64_t>(bytes), remaining_);
+                if (!write_(offset_, pos, consumed)) {
+                    return false;
+                }
+                offset_ += consumed;
+                remaining_ -= consumed;
+                if (!remaining_ && !FinishOp()) {
+                    return false;
+                }
+                break;
+            case State::kDone:
+                LOG(ERROR) << "unexpected data after the end of the delta";
+                return false;
+        }
+        pos += consumed;
+        bytes -= consumed;
+    }
+    return true;
+}
+
+bool DeltaDecoder::ParseFileHeader() {
+    if (!ParseHeader(header_.data(), header_.size(), &file_header_)) {
+        return false;
+    }
+    written_.assign(file_header_.image_size / file_header_.block_size, false);
+
+    remaining_ = Load<uint16_t>(header_.data(), 6) - kDeltaHeaderSize;
+    header_.clear();
+    if (remaining_) {
+        state_ = State::kSkipHeader;
+    } else if (file_header_.total_ops) {
+        state_ = State::kOpHeader;
+    } else {
+        state_ = State::kDone;
+    }
+    return true;
+}
+
+bool DeltaDecoder::ParseOpHeader() {
+    const uint8_t* header = header_.data();
+    uint16_t type = Load<uint16_t>(header, 0);
+    uint64_t count = Load<uint32_t>(header, 4);
+    uint64_t dest = Load<uint64_t>(header, 8);
+    uint64_t source = Load<uint64_t>(header, 16);
+    header_.clear();
+
+    uint64_t total_blocks = written_.size();
+    if (dest > total_blocks || count > total_blocks - dest) {
+        LOG(ERROR) << "delta op " << ops_done_ << " writes past the end of the image";
+        return false;
+    }
+
+    uint64_t block_size = file_header_.block_size;
+    switch (type) {
+        case kOpData:
+            offset_ = dest * block_size;
+            remaining_ = count * block_size;
+            MarkWritten(dest, count);
+            if (!remaining_) {
+                return FinishOp();
+            }
+            state_ = State::kOpData;
+            return true;
+        case kOpZero:
+            MarkWritten(dest, count);
+            return zero_(dest * block_size, count * block_size) && FinishOp();
+        case kOpCopy:
+            if (source > total_blocks || count > total_blocks - source) {
+                LOG(ERROR) << "delta op " << ops_done_ << " reads past the end of the image";
+                return false;
+            }
+            if (source < dest + count && dest < source + count) {
+                LOG(ERROR) << "delta op " << ops_done_ << " copies onto itself";
+                return false;
+            }
+            if (AnyWritten(source, count)) {
+                LOG(ERROR) << "delta op " << ops_done_
+                           << " reads blocks overwritten by an earlier op";
+                return false;
+            }
+            MarkWritten(dest, count);
+            return copy_(source * block_size, dest * block_size, count * block_size) &&
+                   FinishOp();
+        default:
+            LOG(ERROR) << "unknown delta op type " << type;
+            return false;
+    }
+}
+
+bool DeltaDecoder::FinishOp() {
+    if (++ops_done_ < file_header_.total_ops) {
+        state_ = State::kOpHeader;
+    } else {
+        state_ = State::kDone;
+    }
+    return true;
+}
+
+bool DeltaDecoder::AnyWritten(uint64_t block, uint64_t count) const {
+    auto begin = written_.begin() + block;
+    return std::find(begin, begin + count, true) != begin + count;
+}
+
+void DeltaDecoder::MarkWritten(uint64_t block, uint64_t count) {
+    std::fill(written_.begin() + block, written_.begin() + block + count, true);
+}
+
+}  // namespace gsi
+}  // namespace android
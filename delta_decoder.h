@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace gsi {
+
+// A delta stream turns one GSI image into another of the same size, in
+// place. All integers are little-endian.
+//
+// The stream starts with a header:
+//   0  u32  magic, kDeltaMagic
+//   4  u16  major version, 1
+//   6  u16  header size, at least kDeltaHeaderSize
+//   8  u32  block size, a multiple of 4096 of at most 16MiB
+//   12 u32  number of ops
+//   16 u64  image size, a multiple of the block size
+//   24 u8[32] stripe digest of the source image, or zeroes if unknown
+//   56 u8[32] stripe digest of the target image, or zeroes if unknown
+//
+// Each op has a 24-byte header:
+//   0  u16  type: 1 = DATA, 2 = ZERO, 3 = COPY
+//   2  u16  reserved, 0
+//   4  u32  number of blocks
+//   8  u64  destination block
+//   16 u64  source block (COPY only)
+// A DATA op is followed by the data for its blocks.
+//
+// Blocks not covered by any op keep their contents. Since the image is
+// updated in place, a COPY may only read blocks that no earlier op has
+// written, and its source and destination may not overlap.
+static constexpr uint32_t kDeltaMagic = 0x544c4447;  // "GDLT"
+static constexpr size_t kDeltaHeaderSize = 88;
+
+struct DeltaHeader {
+    uint32_t block_size;
+    uint32_t total_ops;
+    uint64_t image_size;
+    // In hex, or empty if not given.
+    std::string source_digest;
+    std::string target_digest;
+};
+
+// Decode a delta stream as it arrives, in chunks of any size.
+class DeltaDecoder {
+  public:
+    // Write |bytes| of data at |offset| in the image.
+    using WriteFn = std::function<bool(uint64_t offset, const void* data, uint64_t bytes)>;
+    // Write |bytes| of zeroes at |offset| in the image.
+    using ZeroFn = std::function<bool(uint64_t offset, uint64_t bytes)>;
+    // Copy |bytes| from |source| to |dest| in the image.
+    using CopyFn = std::function<bool(uint64_t source, uint64_t dest, uint64_t bytes)>;
+
+    DeltaDecoder(WriteFn&& write, ZeroFn&& zero, CopyFn&& copy);
+
+    // Parse the header at the start of a delta stream.
+    static bool ParseHeader(const void* data, size_t bytes, DeltaHeader* header);
+
+    bool Decode(const void* data, size_t bytes);
+
+    // True once every op described by the header has been applied.
+    bool finished() const { return state_ == State::kDone; }
+
+  private:
+    enum class State {
+        kFileHeader,
+        kSkipHeader,
+        kOpHeader,
+        kOpData,
+        kDone,
+    };
+
+    bool ParseFileHeader();
+    bool ParseOpHeader();
+    bool FinishOp();
+    // Accumulate up to |size| bytes into header_, returning the number of
+    // bytes consumed from |data|.
+    size_t Buffer(const uint8_t* data, size_t bytes, size_t size);
+    bool AnyWritten(uint64_t block, uint64_t count) const;
+    void MarkWritten(uint64_t block, uint64_t count);
+
+    WriteFn write_;
+    ZeroFn zero_;
+    CopyFn copy_;
+
+    State state_ = State::kFileHeader;
+    std::vector<uint8_t> header_;
+    DeltaHeader file_header_ = {};
+    // Bytes of the current header or op data still to be consumed, and the
+    // image offset the next op data goes to.
+    uint64_t remaining_ = 0;
+    uint64_t offset_ = 0;
+    uint32_t ops_done_ = 0;
+    // One bit per image block, set once an op has written it.
+    std::vector<bool> written_;
+};
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "extent_planner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fsmap.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+// These are not in the uapi headers.
+#define F2FS_IOCTL_MAGIC 0xf5
+#define F2FS_IOC_GARBAGE_COLLECT _IOW(F2FS_IOCTL_MAGIC, 6, __u32)
+
+namespace android {
+namespace gsi {
+
+using android::base::unique_fd;
+
+// Number of records fetched per FS_IOC_GETFSMAP call.
+static constexpr unsigned kFsmapRecords = 128;
+// Free runs smaller than this are not worth a piece of their own.
+static constexpr uint64_t kMinPlannedPieceSize = 64 * 1024 * 1024;
+// Keep the number of files backing an image manageable.
+static constexpr size_t kMaxPlannedPieces = 64;
+
+bool GetFreeRuns(const std::string& dir, std::vector<uint64_t>* runs) {
+    unique_fd fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << dir;
+        return false;
+    }
+
+    size_t head_size = sizeof(struct fsmap_head) + kFsmapRecords * sizeof(struct fsmap);
+    std::unique_ptr<struct fsmap_head, decltype(&free)> head(
+            reinterpret_cast<struct fsmap_head*>(calloc(1, head_size)), &free);
+    if (!head) {
+        LOG(ERROR) << "could not allocate fsmap buffer";
+        return false;
+    }
+    head->fmh_count = kFsmapRecords;
+    head->fmh_keys[1].fmr_device = UINT32_MAX;
+    head->fmh_keys[1].fmr_flags = UINT32_MAX;
+    head->fmh_keys[1].fmr_physical = UINT64_MAX;
+    head->fmh_keys[1].fmr_owner = UINT64_MAX;
+    head->fmh_keys[1].fmr_offset = UINT64_MAX;
+
+    runs->clear();
+    while (true) {
+        if (ioctl(fd, FS_IOC_GETFSMAP, head.get())) {
+            if (errno != ENOTTY && errno != EOPNOTSUPP) {
+                PLOG(ERROR) << "FS_IOC_GETFSMAP " << dir;
+            }
+            return false;
+        }
+        if (!head->fmh_entries) {
+            break;
+        }
+        for (unsigned i = 0; i < head->fmh_entries; i++) {
+            const auto& record = head->fmh_recs[i];
+            if (record.fmr_owner == FMR_OWN_FREE) {
+                runs->emplace_back(record.fmr_length);
+            }
+        }
+        if (head->fmh_recs[head->fmh_entries - 1].fmr_flags & FMR_OF_LAST) {
+            break;
+        }
+        fsmap_advance(head.get());
+    }
+    std::sort(runs->begin(), runs->end(), std::greater<uint64_t>());
+    return true;
+}
+
+std::vector<uint64_t> PlanImagePieces(const std::vector<uint64_t>& runs, uint64_t size,
+                                      uint64_t block_size, uint64_t max_piece_size) {
+    std::vector<uint64_t> pieces;
+    uint64_t planned = 0;
+    for (uint64_t run : runs) {
+        if (planned == size || pieces.size() + 1 == kMaxPlannedPieces) {
+            break;
+        }
+        uint64_t piece = std::min({run, size - planned, max_piece_size});
+        if (piece < size - planned) {
+            piece -= piece % block_size;
+        }
+        if (piece < kMinPlannedPieceSize && piece < size - planned) {
+            // Runs are sorted, so none of the rest are large enough either.
+            break;
+        }
+        pieces.emplace_back(piece);
+        planned += piece;
+    }
+    for (uint64_t left = size - planned; left;) {
+        uint64_t piece = std::min(left, max_piece_size);
+        if (piece < left) {
+            piece -= piece % block_size;
+        }
+        pieces.emplace_back(piece);
+        left -= piece;
+    }
+    return pieces;
+}
+
+bool CompactFreeSpace(const std::string& dir, const CompactProgressFn& progress) {
+    unique_fd fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << dir;
+        return true;
+    }
+    struct statfs info;
+    if (fstatfs(fd, &info)) {
+        PLOG(ERROR) << "statfs " << dir;
+        return true;
+    }
+    if (info.f_type != F2FS_SUPER_MAGIC) {
+        LOG(INFO) << "cannot compact free space on " << dir << ", fs type " << info.f_type;
+        return true;
+    }
+
+    // Foreground GC moves valid blocks out of the emptiest sections, freeing
+    // them whole. It fails with EAGAIN once there is nothing left worth
+    // collecting.
+    uint64_t rounds = 0;
+    while (rounds < kMaxCompactRounds) {
+        __u32 sync = 1;
+        if (ioctl(fd, F2FS_IOC_GARBAGE_COLLECT, &sync)) {
+            if (errno != EAGAIN) {
+                PLOG(ERROR) << "F2FS_IOC_GARBAGE_COLLECT " << dir;
+            }
+            break;
+        }
+        rounds++;
+        if (!progress(rounds)) {
+            LOG(INFO) << "free space compaction on " << dir << " cancelled after " << rounds
+                      << " sections";
+            return false;
+        }
+    }
+    LOG(INFO) << "garbage collected " << rounds << " sections on " << dir;
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace gsi {
+
+// Find the free space on the filesystem holding |dir|, as the lengths in
+// bytes of its free runs, largest first. Returns false if the filesystem
+// cannot report its free space layout (only ext4 supports FS_IOC_GETFSMAP).
+bool GetFreeRuns(const std::string& dir, std::vector<uint64_t>* runs);
+
+// Choose the piece sizes for an image of |size| bytes so that each piece can
+// be allocated from one of the free runs in |runs|, largest first. Runs too
+// small to be worth a piece of their own are not used; whatever they cannot
+// cover goes into a last piece, which is left to the allocator. Pieces are
+// a multiple of |block_size|, except the last, and no larger than
+// |max_piece_size|.
+std::vector<uint64_t> PlanImagePieces(const std::vector<uint64_t>& runs, uint64_t size,
+                                      uint64_t block_size, uint64_t max_piece_size);
+
+// Upper bound on the sections collected by CompactFreeSpace. Each round
+// collects one section, which is 2MiB by default.
+static constexpr uint64_t kMaxCompactRounds = 512;
+
+// Called after each round of CompactFreeSpace with the number of rounds done.
+// Returning false stops compaction.
+using CompactProgressFn = std::function<bool(uint64_t rounds)>;
+
+// Ask the filesystem holding |dir| to gather its free space into larger runs.
+// Only f2fs can do this, by garbage collecting; for other filesystems this
+// does nothing. Returns false only if |progress| stopped it.
+bool CompactFreeSpace(const std::string& dir, const CompactProgressFn& progress);
+
+}  // namespace gsi
+}  // namespace android
@@ -24,6 +24,10 @@ static constexpr char kDefaultGsiImageFolder[] = "/data/gsi/dsu/";
 static constexpr char kGsiLpMetadataFile[] = "/metadata/gsi/dsu/lp_metadata";
 static constexpr char kGsiOneShotBootFile[] = "/metadata/gsi/dsu/one_shot_boot";
 static constexpr char kGsiInstallDirFile[] = "/metadata/gsi/dsu/install_dir";
+// Progress of an unfinished installation, so that it can be resumed.
+static constexpr char kGsiInstallCheckpointFile[] = "/metadata/gsi/dsu/install_checkpoint";
+// Stripe digest of system_gsi, computed while it was installed.
+static constexpr char kGsiImageDigestFile[] = "/metadata/gsi/dsu/system_gsi_digest";
 
 // This file can contain the following values:
 //   [int]      - boot attempt counter, starting from 0
@@ -16,36 +16,56 @@
 
 #include "gsi_service.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/fs.h>
+#include <linux/magic.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/vfs.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android/gsi/IGsiService.h>
+#include <cutils/ashmem.h>
 #include <ext4_utils/ext4_utils.h>
 #include <fs_mgr.h>
 #include <fs_mgr_dm_linear.h>
 #include <fstab/fstab.h>
 #include <libdm/dm.h>
 #include <libfiemap_writer/fiemap_writer.h>
+#include <liburing.h>
 #include <logwrap/logwrap.h>
 #include <private/android_filesystem_config.h>
+#include <zlib.h>
 
+#include "extent_planner.h"
 #include "file_paths.h"
 #include "libgsi_private.h"
 
+// Not in the uapi headers.
+#define F2FS_IOCTL_MAGIC 0xf5
+#define F2FS_IOC_SET_PIN_FILE _IOW(F2FS_IOCTL_MAGIC, 13, __u32)
+
 namespace android {
 namespace gsi {
 
@@ -67,6 +87,145 @@ static constexpr uint32_t kMaximumExtents = 512;
 // Default userdata image size.
 static constexpr int64_t kDefaultUserdataSize = int64_t(8) * 1024 * 1024 * 1024;
 static constexpr std::chrono::milliseconds kDmTimeout = 5000ms;
+// Progress listeners get an update at most this often, and only once the
+// step has moved on by 1/kProgressPushSteps of its total, or the throughput
+// by 1/kProgressPushRateChange. While an operation is running they also get
+// one every kProgressHeartbeat, so that a stall shows up.
+static constexpr std::chrono::milliseconds kProgressPushInterval = 100ms;
+static constexpr int64_t kProgressPushSteps = 100;
+static constexpr int64_t kProgressPushRateChange = 8;
+static constexpr std::chrono::milliseconds kProgressHeartbeat = 2000ms;
+// Throughput is sampled at most this often, and each sample moves the
+// average 1/kRateSmoothing of the way towards it. Without samples, as when a
+// transfer stalls, the average decays the same way.
+static constexpr int64_t kRateSampleIntervalNs = 250 * 1000 * 1000;
+static constexpr int64_t kRateSmoothing = 4;
+// Number of buffers used to pipeline reads and writes in
+// commitGsiChunkFromStream.
+static constexpr size_t kStreamBufferCount = 4;
+// Bounds for the size of each of those buffers when it is chosen
+// automatically, and the largest size a caller may ask for.
+static constexpr uint64_t kMinDefaultIoBufferSize = 1024 * 1024;
+static constexpr uint64_t kMaxDefaultIoBufferSize = 4 * 1024 * 1024;
+static constexpr int64_t kMaxIoBufferSize = 64 * 1024 * 1024;
+// How often a blocked stream reader checks whether it should give up.
+static constexpr int kStreamPollIntervalMs = 500;
+// How much image data to write between saving install checkpoints.
+static constexpr uint64_t kCheckpointInterval = 256 * 1024 * 1024;
+// Size of the pipes used for splicing, and the most we splice per call.
+static constexpr int kSplicePipeSize = 1024 * 1024;
+// Number of writes kept in flight by UringWriter, and the size of each.
+static constexpr unsigned kUringQueueDepth = 8;
+static constexpr size_t kUringBufferSize = 1024 * 1024;
+// O_DIRECT buffer and offset alignment. This covers both the page size and
+// any logical block size we expect to see.
+static constexpr uint64_t kUringAlignment = 4096;
+// Image data is checked for zeroes in blocks of this size. Only runs of at
+// least kMinZeroRun are zeroed rather than written, so that writes of
+// mostly non-zero data don't get broken up.
+static constexpr uint64_t kZeroBlockSize = 4096;
+static constexpr uint64_t kMinZeroRun = 64 * 1024;
+// Number of threads reading back an image to verify it. Several requests in
+// flight are needed to reach the full read bandwidth of flash storage.
+static constexpr unsigned kVerifyThreads = 4;
+// Pieces of an image on a FAT filesystem must stay under its 4GiB file size
+// limit.
+static constexpr uint64_t kMaxFatPieceSize = 4ULL * 1024 * 1024 * 1024 - 1024 * 1024;
+// Pieces are allocated with fallocate() calls of at most kFallocateBatchSize,
+// so that progress can be reported. Pieces that need to be zeroed are
+// written this many at a time.
+static constexpr unsigned kAllocateThreads = 4;
+static constexpr uint64_t kFallocateBatchSize = 256 * 1024 * 1024;
+// Size of the writes that turn allocated ext4 extents into written ones.
+static constexpr size_t kAllocateZeroSize = 1024 * 1024;
+// Filesystem superblock magic numbers, used to pick a resize tool.
+static constexpr uint64_t kSuperblockOffset = 1024;
+static constexpr uint16_t kExt4Magic = 0xef53;
+static constexpr uint64_t kExt4MagicOffset = kSuperblockOffset + 0x38;
+static constexpr uint32_t kF2fsMagic = 0xf2f52010;
+static constexpr uint64_t kF2fsMagicOffset = kSuperblockOffset;
+// BLKZEROOUT works in units of sectors.
+static constexpr uint64_t kZeroOutAlignment = 512;
+
+// The contents of kGsiInstallCheckpointFile.
+struct InstallCheckpoint {
+    std::string install_dir;
+    uint64_t gsi_size;
+    uint64_t userdata_size;
+    uint64_t bytes_written;
+    bool has_checksum;
+    uint32_t checksum;
+    // Whether userdata_gsi was created by this install, and so must be
+    // removed if it fails.
+    bool wipe_userdata_on_failure;
+};
+
+// The checkpoint is stored as one value per line, with "-" standing in for
+// a checksum that isn't known. Checkpoints written before the last line was
+// added keep userdata_gsi on failure.
+static bool ReadInstallCheckpoint(InstallCheckpoint* checkpoint) {
+    std::string contents;
+    if (!android::base::ReadFileToString(kGsiInstallCheckpointFile, &contents)) {
+        return false;
+    }
+    auto lines = android::base::Split(android::base::Trim(contents), "\n");
+    if (lines.size() != 5 && lines.size() != 6) {
+        LOG(ERROR) << "malformed checkpoint file: " << kGsiInstallCheckpointFile;
+        return false;
+    }
+    checkpoint->install_dir = lines[0];
+    checkpoint->has_checksum = (lines[4] != "-");
+    checkpoint->checksum = 0;
+    checkpoint->wipe_userdata_on_failure = (lines.size() == 6 && lines[5] == "1");
+    if (!android::base::ParseUint(lines[1], &checkpoint->gsi_size) ||
+        !android::base::ParseUint(lines[2], &checkpoint->userdata_size) ||
+        !android::base::ParseUint(lines[3], &checkpoint->bytes_written) ||
+        (checkpoint->has_checksum && !android::base::ParseUint(lines[4], &checkpoint->checksum))) {
+        LOG(ERROR) << "malformed checkpoint file: " << kGsiInstallCheckpointFile;
+        return false;
+    }
+    return true;
+}
+
+// Write to a temporary file first, so that a crash can't leave a torn file
+// behind. The directory is synced too, so that once this returns the new
+// file survives a crash.
+static bool WriteFileAtomically(const std::string& path, const std::string& contents) {
+    std::string temp_file = path + ".tmp";
+    unique_fd fd(open(temp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                      0644));
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << temp_file;
+        return false;
+    }
+    if (!android::base::WriteStringToFd(contents, fd) || fsync(fd)) {
+        PLOG(ERROR) << "write " << temp_file;
+        android::base::RemoveFileIfExists(temp_file);
+        return false;
+    }
+    if (rename(temp_file.c_str(), path.c_str())) {
+        PLOG(ERROR) << "rename " << temp_file;
+        android::base::RemoveFileIfExists(temp_file);
+        return false;
+    }
+
+    std::string dir = android::base::Dirname(path);
+    unique_fd dir_fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dir_fd < 0 || fsync(dir_fd)) {
+        PLOG(ERROR) << "fsync " << dir;
+        return false;
+    }
+    return true;
+}
+
+static bool WriteInstallCheckpoint(const InstallCheckpoint& checkpoint) {
+    std::string checksum = checkpoint.has_checksum ? std::to_string(checkpoint.checksum) : "-";
+    std::string contents = checkpoint.install_dir + "\n" + std::to_string(checkpoint.gsi_size) +
+                           "\n" + std::to_string(checkpoint.userdata_size) + "\n" +
+                           std::to_string(checkpoint.bytes_written) + "\n" + checksum + "\n" +
+                           (checkpoint.wipe_userdata_on_failure ? "1" : "0") + "\n";
+    return WriteFileAtomically(kGsiInstallCheckpointFile, contents);
+}
 
 void GsiService::Register() {
     auto ret = android::BinderService<GsiService>::publish();
@@ -75,12 +234,19 @@ void GsiService::Register() {
     }
 }
 
-GsiService::GsiService() {
-    progress_ = {};
-}
+GsiService::GsiService() {}
 
 GsiService::~GsiService() {
     PostInstallCleanup();
+
+    {
+        std::lock_guard<std::mutex> guard(listener_lock_);
+        stop_notifier_ = true;
+        listener_cv_.notify_all();
+    }
+    if (notifier_thread_.joinable()) {
+        notifier_thread_.join();
+    }
 }
 
 #define ENFORCE_SYSTEM                          \
@@ -101,6 +267,8 @@ binder::Status GsiService::startGsiInstall(int64_t gsiSize, int64_t userdataSize
     params.gsiSize = gsiSize;
     params.userdataSize = userdataSize;
     params.wipeUserdata = wipeUserdata;
+    params.ioBufferSize = 0;
+    params.compression = COMPRESSION_NONE;
     return beginGsiInstall(params, _aidl_return);
 }
 
@@ -113,10 +281,14 @@ binder::Status GsiService::beginGsiInstall(const GsiInstallParams& given_params,
 
     // Do some precursor validation on the arguments before diving into the
     // install process.
+    install_report_.Reset();
     GsiInstallParams params = given_params;
-    if (int status = ValidateInstallParams(&params)) {
-        *_aidl_return = status;
-        return binder::Status::ok();
+    {
+        InstallReport::Phase phase(&install_report_, "ValidateInstallParams");
+        if (int status = ValidateInstallParams(&params)) {
+            *_aidl_return = status;
+            return binder::Status::ok();
+        }
     }
 
     int status = StartInstall(params);
@@ -132,43 +304,192 @@ binder::Status GsiService::beginGsiInstall(const GsiInstallParams& given_params,
     return binder::Status::ok();
 }
 
+binder::Status GsiService::resumeGsiInstall(const GsiInstallParams& given_params,
+                                            int64_t* _aidl_return) {
+    ENFORCE_SYSTEM;
+    std::lock_guard<std::mutex> guard(main_lock_);
+
+    // Any state left over from the interrupted attempt is rebuilt from disk.
+    PostInstallCleanup();
+
+    install_report_.Reset();
+    GsiInstallParams params = given_params;
+    if (ValidateInstallParams(&params)) {
+        *_aidl_return = -1;
+        return binder::Status::ok();
+    }
+
+    {
+        InstallReport::Phase phase(&install_report_, "ResumeInstall");
+        *_aidl_return = ResumeInstall(params);
+    }
+    if (*_aidl_return < 0) {
+        // Leave the images in place, so that another attempt can be made.
+        PostInstallCleanup();
+    }
+
+    // Clear the progress indicator.
+    UpdateProgress(STATUS_NO_OPERATION, 0);
+    return binder::Status::ok();
+}
+
 binder::Status GsiService::commitGsiChunkFromStream(const android::os::ParcelFileDescriptor& stream,
                                                     int64_t bytes, bool* _aidl_return) {
     ENFORCE_SYSTEM;
     std::lock_guard<std::mutex> guard(main_lock_);
 
-    *_aidl_return = CommitGsiChunk(stream.get(), bytes);
+    {
+        InstallReport::Phase phase(&install_report_, "commitGsiChunkFromStream");
+        *_aidl_return = CommitGsiChunk(stream.get(), bytes);
+    }
 
     // Clear the progress indicator.
     UpdateProgress(STATUS_NO_OPERATION, 0);
     return binder::Status::ok();
 }
 
+static int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
 void GsiService::StartAsyncOperation(const std::string& step, int64_t total_bytes) {
-    std::lock_guard<std::mutex> guard(progress_lock_);
+    std::lock_guard<std::mutex> guard(progress_step_lock_);
+    const std::string* name = &*progress_steps_.emplace(step).first;
+    int64_t now = NowNs();
+    {
+        std::lock_guard<std::mutex> rate_guard(rate_lock_);
+        rate_sample_ns_ = now;
+        rate_sample_bytes_ = 0;
+        rate_known_ = false;
+        rate_average_ = 0;
+    }
 
-    progress_.step = step;
-    progress_.status = STATUS_WORKING;
-    progress_.bytes_processed = 0;
-    progress_.total_bytes = total_bytes;
+    uint32_t seq = progress_seq_.load(std::memory_order_relaxed);
+    progress_seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    progress_step_.store(name, std::memory_order_relaxed);
+    progress_status_.store(STATUS_WORKING, std::memory_order_relaxed);
+    progress_bytes_processed_.store(0, std::memory_order_relaxed);
+    progress_total_bytes_.store(total_bytes, std::memory_order_relaxed);
+    progress_io_path_.store(IO_PATH_NONE, std::memory_order_relaxed);
+    progress_bytes_zeroed_.store(0, std::memory_order_relaxed);
+    progress_start_ns_.store(now, std::memory_order_relaxed);
+    progress_end_ns_.store(0, std::memory_order_relaxed);
+
+    progress_seq_.store(seq + 2, std::memory_order_release);
+
+    // Wake the notifier thread if it is waiting for an operation to start.
+    std::lock_guard<std::mutex> listener_guard(listener_lock_);
+    listener_cv_.notify_all();
 }
 
 void GsiService::UpdateProgress(int status, int64_t bytes_processed) {
-    std::lock_guard<std::mutex> guard(progress_lock_);
-
-    progress_.status = status;
     if (status == STATUS_COMPLETE) {
-        progress_.bytes_processed = progress_.total_bytes;
+        bytes_processed = progress_total_bytes_.load(std::memory_order_relaxed);
+        progress_end_ns_.store(NowNs(), std::memory_order_relaxed);
+    } else if (status == STATUS_WORKING) {
+        SampleRate(bytes_processed);
+    }
+    // The count goes first, so that a reader that sees STATUS_COMPLETE also
+    // sees the final count.
+    progress_bytes_processed_.store(bytes_processed, std::memory_order_relaxed);
+    progress_status_.store(status, std::memory_order_release);
+}
+
+void GsiService::SetProgressIoPath(int io_path) {
+    progress_io_path_.store(io_path, std::memory_order_relaxed);
+}
+
+void GsiService::SampleRate(int64_t bytes_processed) {
+    int64_t now = NowNs();
+    if (now - rate_sample_ns_.load(std::memory_order_relaxed) < kRateSampleIntervalNs) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(rate_lock_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    // Another thread may have taken a sample since the check above.
+    int64_t elapsed = now - rate_sample_ns_;
+    if (elapsed < kRateSampleIntervalNs) {
+        return;
+    }
+
+    int64_t bytes = std::max(bytes_processed - rate_sample_bytes_, int64_t(0));
+    int64_t rate = bytes * 1000 / (elapsed / 1000000);
+    int64_t average = rate_average_;
+    if (rate_known_) {
+        average += (rate - average) / kRateSmoothing;
     } else {
-        progress_.bytes_processed = bytes_processed;
+        average = rate;
+        rate_known_ = true;
+    }
+    rate_average_ = average;
+    rate_sample_bytes_ = bytes_processed;
+    rate_sample_ns_ = now;
+}
+
+GsiProgress GsiService::GetProgress() {
+    GsiProgress progress;
+    const std::string* step;
+    int64_t start_ns, end_ns;
+    while (true) {
+        uint32_t seq = progress_seq_.load(std::memory_order_acquire);
+        if (seq & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        step = progress_step_.load(std::memory_order_relaxed);
+        progress.status = progress_status_.load(std::memory_order_acquire);
+        progress.bytes_processed = progress_bytes_processed_.load(std::memory_order_relaxed);
+        progress.total_bytes = progress_total_bytes_.load(std::memory_order_relaxed);
+        progress.io_path = progress_io_path_.load(std::memory_order_relaxed);
+        progress.bytes_zeroed = progress_bytes_zeroed_.load(std::memory_order_relaxed);
+        start_ns = progress_start_ns_.load(std::memory_order_relaxed);
+        end_ns = progress_end_ns_.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (progress_seq_.load(std::memory_order_relaxed) == seq) {
+            break;
+        }
+    }
+    if (step) {
+        progress.step = *step;
+    }
+
+    progress.bytes_per_second = 0;
+    progress.eta_ms = -1;
+    progress.elapsed_ms = 0;
+    if (progress.status == STATUS_NO_OPERATION) {
+        return progress;
+    }
+    int64_t now = NowNs();
+    progress.elapsed_ms = ((end_ns ? end_ns : now) - start_ns) / 1000000;
+    if (progress.status == STATUS_COMPLETE) {
+        progress.eta_ms = 0;
+        return progress;
+    }
+
+    // Decay the average for each interval with no sample, so that a stalled
+    // transfer shows up as one.
+    int64_t rate = rate_average_.load(std::memory_order_relaxed);
+    int64_t missed = (now - rate_sample_ns_.load(std::memory_order_relaxed)) /
+                     kRateSampleIntervalNs - 1;
+    for (int64_t i = 0; i < missed && rate > 0; i++) {
+        rate -= std::max(rate / kRateSmoothing, int64_t(1));
     }
+    progress.bytes_per_second = rate;
+    if (rate > 0 && progress.total_bytes >= progress.bytes_processed) {
+        progress.eta_ms = (progress.total_bytes - progress.bytes_processed) * 1000 / rate;
+    }
+    return progress;
 }
 
 binder::Status GsiService::getInstallProgress(::android::gsi::GsiProgress* _aidl_return) {
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(progress_lock_);
-
-    *_aidl_return = progress_;
+    *_aidl_return = GetProgress();
     return binder::Status::ok();
 }
 
@@ -177,16 +498,39 @@ binder::Status GsiService::commitGsiChunkFromMemory(const std::vector<uint8_t>&
     ENFORCE_SYSTEM;
     std::lock_guard<std::mutex> guard(main_lock_);
 
+    InstallReport::Phase phase(&install_report_, "commitGsiChunkFromMemory");
     *_aidl_return = CommitGsiChunk(bytes.data(), bytes.size());
     return binder::Status::ok();
 }
 
+binder::Status GsiService::setGsiAshmem(const ::android::os::ParcelFileDescriptor& ashmem,
+                                        int64_t size, bool* _aidl_return) {
+    ENFORCE_SYSTEM;
+    std::lock_guard<std::mutex> guard(main_lock_);
+
+    *_aidl_return = MapAshmem(ashmem.get(), size);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::commitGsiChunkFromAshmem(int64_t bytes, bool* _aidl_return) {
+    ENFORCE_SYSTEM;
+    std::lock_guard<std::mutex> guard(main_lock_);
+
+    InstallReport::Phase phase(&install_report_, "commitGsiChunkFromAshmem");
+    *_aidl_return = CommitGsiChunkFromAshmem(bytes);
+    return binder::Status::ok();
+}
+
 binder::Status GsiService::setGsiBootable(bool one_shot, int* _aidl_return) {
     std::lock_guard<std::mutex> guard(main_lock_);
 
     if (installing_) {
         ENFORCE_SYSTEM;
-        int error = SetGsiBootable(one_shot);
+        int error;
+        {
+            InstallReport::Phase phase(&install_report_, "SetGsiBootable");
+            error = SetGsiBootable(one_shot);
+        }
         PostInstallCleanup();
         if (error) {
             RemoveGsiFiles(install_dir_, wipe_userdata_on_failure_);
@@ -205,7 +549,8 @@ binder::Status GsiService::setGsiBootable(bool one_shot, int* _aidl_return) {
 
 binder::Status GsiService::isGsiEnabled(bool* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(main_lock_);
+    // Status queries only look at files on disk and atomics, so that they
+    // never wait behind an install holding main_lock_.
     std::string boot_key;
     if (!GetInstallStatus(&boot_key)) {
         *_aidl_return = false;
@@ -247,24 +592,18 @@ binder::Status GsiService::disableGsiInstall(bool* _aidl_return) {
 
 binder::Status GsiService::isGsiRunning(bool* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(main_lock_);
-
     *_aidl_return = IsGsiRunning();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::isGsiInstalled(bool* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(main_lock_);
-
     *_aidl_return = IsGsiInstalled();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::isGsiInstallInProgress(bool* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(main_lock_);
-
     *_aidl_return = installing_;
     return binder::Status::ok();
 }
@@ -286,47 +625,12 @@ binder::Status GsiService::cancelGsiInstall(bool* _aidl_return) {
 
 binder::Status GsiService::getGsiBootStatus(int* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(main_lock_);
-
-    if (!IsGsiInstalled()) {
-        *_aidl_return = BOOT_STATUS_NOT_INSTALLED;
-        return binder::Status::ok();
-    }
-
-    std::string boot_key;
-    if (!GetInstallStatus(&boot_key)) {
-        PLOG(ERROR) << "read " << kGsiInstallStatusFile;
-        *_aidl_return = BOOT_STATUS_NOT_INSTALLED;
-        return binder::Status::ok();
-    }
-
-    bool single_boot = !access(kGsiOneShotBootFile, F_OK);
-
-    if (boot_key == kInstallStatusWipe) {
-        // This overrides all other statuses.
-        *_aidl_return = BOOT_STATUS_WILL_WIPE;
-    } else if (boot_key == kInstallStatusDisabled) {
-        // A single-boot GSI will have a "disabled" status, because it's
-        // disabled immediately upon reading the one_shot_boot file. However,
-        // we still want to return SINGLE_BOOT, because it makes the
-        // transition clearer to the user.
-        if (single_boot) {
-            *_aidl_return = BOOT_STATUS_SINGLE_BOOT;
-        } else {
-            *_aidl_return = BOOT_STATUS_DISABLED;
-        }
-    } else if (single_boot) {
-        *_aidl_return = BOOT_STATUS_SINGLE_BOOT;
-    } else {
-        *_aidl_return = BOOT_STATUS_ENABLED;
-    }
+    *_aidl_return = GetBootStatus();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::getUserdataImageSize(int64_t* _aidl_return) {
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(main_lock_);
-
     *_aidl_return = -1;
 
     if (installing_) {
@@ -365,8 +669,6 @@ binder::Status GsiService::getUserdataImageSize(int64_t* _aidl_return) {
 
 binder::Status GsiService::getInstalledGsiImageDir(std::string* _aidl_return) {
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(main_lock_);
-
     if (IsGsiInstalled()) {
         *_aidl_return = GetInstalledImageDir();
     }
@@ -387,108 +689,396 @@ binder::Status GsiService::wipeGsiUserdata(int* _aidl_return) {
     return binder::Status::ok();
 }
 
-binder::Status GsiService::CheckUid(AccessLevel level) {
-    std::vector<uid_t> allowed_uids{AID_ROOT, AID_SYSTEM};
-    if (level == AccessLevel::SystemOrShell) {
-        allowed_uids.push_back(AID_SHELL);
-    }
+binder::Status GsiService::resizeGsiUserdata(int64_t newSize, int* _aidl_return) {
+    ENFORCE_SYSTEM;
+    std::lock_guard<std::mutex> guard(main_lock_);
 
-    uid_t uid = IPCThreadState::self()->getCallingUid();
-    for (const auto& allowed_uid : allowed_uids) {
-        if (allowed_uid == uid) {
-            return binder::Status::ok();
-        }
+    if (installing_ || IsGsiRunning() || !IsGsiInstalled() || newSize <= 0 ||
+        newSize % LP_SECTOR_SIZE) {
+        *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
     }
 
-    auto message = StringPrintf("UID %d is not allowed", uid);
-    return binder::Status::fromExceptionCode(binder::Status::EX_SECURITY,
-                                             String8(message.c_str()));
+    *_aidl_return = ResizeUserdata(newSize);
+    PostInstallCleanup();
+
+    // Clear the progress indicator.
+    UpdateProgress(STATUS_NO_OPERATION, 0);
+    return binder::Status::ok();
 }
 
-void GsiService::PostInstallCleanup() {
-    // This must be closed before unmapping partitions.
-    system_writer_ = nullptr;
+binder::Status GsiService::verifyGsiInstall(const std::string& expectedDigest,
+                                            int* _aidl_return) {
+    ENFORCE_SYSTEM_OR_SHELL;
+    std::lock_guard<std::mutex> guard(main_lock_);
 
-    const auto& dm = DeviceMapper::Instance();
-    if (dm.GetState("userdata_gsi") != DmDeviceState::INVALID) {
-        DestroyLogicalPartition("userdata_gsi", kDmTimeout);
-    }
-    if (dm.GetState("system_gsi") != DmDeviceState::INVALID) {
-        DestroyLogicalPartition("system_gsi", kDmTimeout);
+    if (installing_ || IsGsiRunning() || !IsGsiInstalled()) {
+        *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
     }
 
-    installing_ = false;
-    partitions_ .clear();
+    *_aidl_return = VerifyInstall(expectedDigest);
+    PostInstallCleanup();
+
+    // Clear the progress indicator.
+    UpdateProgress(STATUS_NO_OPERATION, 0);
+    return binder::Status::ok();
 }
 
-static bool IsExternalStoragePath(const std::string& path) {
-    if (!android::base::StartsWith(path, "/mnt/media_rw/")) {
-        return false;
-    }
-    unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW));
-    if (fd < 0) {
-        PLOG(ERROR) << "open failed: " << path;
-        return false;
-    }
-    struct statfs info;
-    if (fstatfs(fd, &info)) {
-        PLOG(ERROR) << "statfs failed: " << path;
-        return false;
+binder::Status GsiService::applyGsiDelta(const android::os::ParcelFileDescriptor& stream,
+                                         int64_t bytes, int* _aidl_return) {
+    ENFORCE_SYSTEM;
+    std::lock_guard<std::mutex> guard(main_lock_);
+
+    if (installing_ || IsGsiRunning() || !IsGsiInstalled() || bytes <= 0) {
+        *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
     }
-    LOG(ERROR) << "fs type: " << info.f_type;
-    return info.f_type == MSDOS_SUPER_MAGIC;
+
+    *_aidl_return = ApplyDelta(stream.get(), bytes);
+    PostInstallCleanup();
+
+    // Clear the progress indicator.
+    UpdateProgress(STATUS_NO_OPERATION, 0);
+    return binder::Status::ok();
 }
 
-int GsiService::ValidateInstallParams(GsiInstallParams* params) {
-    // If no install path was specified, use the default path. We also allow
-    // specifying the top-level folder, and then we choose the correct location
-    // underneath.
-    if (params->installDir.empty() || params->installDir == "/data/gsi") {
-        params->installDir = kDefaultGsiImageFolder;
+binder::Status GsiService::getGsiBlockManifest(android::os::ParcelFileDescriptor* _aidl_return) {
+    return getImageBlockManifest("system_gsi", _aidl_return);
+}
+
+binder::Status GsiService::getImageBlockManifest(const std::string& name,
+                                                 android::os::ParcelFileDescriptor* _aidl_return) {
+    ENFORCE_SYSTEM_OR_SHELL;
+    std::lock_guard<std::mutex> guard(main_lock_);
+
+    if (installing_ || IsGsiRunning() || !IsGsiInstalled()) {
+        return binder::Status::fromServiceSpecificError(INSTALL_ERROR_GENERIC,
+                                                        String8("no GSI image is available"));
     }
 
-    // Normalize the path and add a trailing slash.
-    std::string origInstallDir = params->installDir;
-    if (!android::base::Realpath(origInstallDir, &params->installDir)) {
-        PLOG(ERROR) << "realpath failed: " << origInstallDir;
-        return INSTALL_ERROR_GENERIC;
+    unique_fd fd;
+    int error = GetBlockManifest(name, &fd);
+    PostInstallCleanup();
+    // Clear the progress indicator.
+    UpdateProgress(STATUS_NO_OPERATION, 0);
+    if (error) {
+        return binder::Status::fromServiceSpecificError(error,
+                                                        String8("could not get block manifest"));
     }
-    // Ensure the path ends in / for consistency. Even though GetImagePath()
-    // does this already, we want it to appear this way in install_dir.
-    if (!android::base::EndsWith(params->installDir, "/")) {
-        params->installDir += "/";
+    *_aidl_return = android::os::ParcelFileDescriptor(std::move(fd));
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::registerProgressListener(const sp<IGsiProgressListener>& listener) {
+    ENFORCE_SYSTEM;
+    if (!listener) {
+        return binder::Status::fromExceptionCode(binder::Status::EX_ILLEGAL_ARGUMENT,
+                                                 String8("listener is null"));
     }
 
-    // Currently, we can only install to /data/gsi/ or external storage.
-    if (IsExternalStoragePath(params->installDir)) {
-        Fstab fstab;
-        if (!ReadDefaultFstab(&fstab)) {
-            LOG(ERROR) << "cannot read default fstab";
-            return INSTALL_ERROR_GENERIC;
+    auto binder = IInterface::asBinder(listener);
+    {
+        std::lock_guard<std::mutex> guard(listener_lock_);
+        for (const auto& registered : progress_listeners_) {
+            if (IInterface::asBinder(registered) == binder) {
+                return binder::Status::fromExceptionCode(binder::Status::EX_ILLEGAL_STATE,
+                                                         String8("listener already registered"));
+            }
         }
-        FstabEntry* system = GetEntryForMountPoint(&fstab, "/system");
-        if (!system) {
-            LOG(ERROR) << "cannot find /system fstab entry";
-            return INSTALL_ERROR_GENERIC;
+        if (binder->remoteBinder() && binder->linkToDeath(this) != android::OK) {
+            return binder::Status::fromExceptionCode(binder::Status::EX_ILLEGAL_STATE,
+                                                     String8("listener has died"));
         }
-        if (fs_mgr_verity_is_check_at_most_once(*system)) {
-            LOG(ERROR) << "cannot install GSIs to external media if verity uses check_at_most_once";
-            return INSTALL_ERROR_GENERIC;
+        progress_listeners_.emplace_back(listener);
+        if (!notifier_running_) {
+            // A previous thread may have seen the list empty and be exiting.
+            if (notifier_thread_.joinable()) {
+                notifier_thread_.join();
+            }
+            notifier_running_ = true;
+            notifier_thread_ = std::thread([this]() -> void { NotifyProgressListeners(); });
         }
-    } else if (params->installDir != kDefaultGsiImageFolder) {
-        LOG(ERROR) << "cannot install GSI to " << params->installDir;
-        return INSTALL_ERROR_GENERIC;
     }
 
-    if (params->gsiSize % LP_SECTOR_SIZE) {
-        LOG(ERROR) << "GSI size " << params->gsiSize << " is not a multiple of " << LP_SECTOR_SIZE;
-        return INSTALL_ERROR_GENERIC;
-    }
-    if (params->userdataSize % LP_SECTOR_SIZE) {
-        LOG(ERROR) << "userdata size " << params->userdataSize << " is not a multiple of "
+    // The notifier only sends changes, so tell the new listener where things
+    // stand.
+    listener->onProgress(GetProgress());
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::unregisterProgressListener(const sp<IGsiProgressListener>& listener) {
+    ENFORCE_SYSTEM;
+    if (!listener) {
+        return binder::Status::fromExceptionCode(binder::Status::EX_ILLEGAL_ARGUMENT,
+                                                 String8("listener is null"));
+    }
+
+    auto binder = IInterface::asBinder(listener);
+    std::lock_guard<std::mutex> guard(listener_lock_);
+    if (RemoveProgressListener(binder.get()) && binder->remoteBinder()) {
+        binder->unlinkToDeath(this);
+    }
+    return binder::Status::ok();
+}
+
+void GsiService::binderDied(const wp<IBinder>& who) {
+    std::lock_guard<std::mutex> guard(listener_lock_);
+    if (RemoveProgressListener(who.unsafe_get())) {
+        LOG(INFO) << "dropping the progress listener of a dead client";
+    }
+}
+
+bool GsiService::RemoveProgressListener(const IBinder* binder) {
+    auto iter = std::remove_if(progress_listeners_.begin(), progress_listeners_.end(),
+                               [&](const sp<IGsiProgressListener>& registered) -> bool {
+                                   return IInterface::asBinder(registered).get() == binder;
+                               });
+    if (iter == progress_listeners_.end()) {
+        return false;
+    }
+    progress_listeners_.erase(iter, progress_listeners_.end());
+    // The notifier exits once the list is empty.
+    listener_cv_.notify_all();
+    return true;
+}
+
+// Runs on notifier_thread_ until there are no listeners left. Progress is
+// sampled rather than pushed from UpdateProgress(), which must stay cheap.
+void GsiService::NotifyProgressListeners() {
+    GsiProgress last;
+    bool sent = false;
+    auto last_sent = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(listener_lock_);
+    while (!stop_notifier_ && !progress_listeners_.empty()) {
+        if (sent && last.status == STATUS_NO_OPERATION) {
+            // Nothing will change until StartAsyncOperation() wakes us.
+            listener_cv_.wait(lock, [this] {
+                return stop_notifier_ || progress_listeners_.empty() ||
+                       progress_status_.load(std::memory_order_relaxed) != STATUS_NO_OPERATION;
+            });
+        } else {
+            listener_cv_.wait_for(lock, kProgressPushInterval, [this] {
+                return stop_notifier_ || progress_listeners_.empty();
+            });
+        }
+        if (stop_notifier_ || progress_listeners_.empty()) {
+            break;
+        }
+
+        GsiProgress progress = GetProgress();
+        bool new_step = !sent || progress.step != last.step ||
+                        progress.total_bytes != last.total_bytes ||
+                        progress.bytes_processed < last.bytes_processed;
+        int64_t min_advance = std::max(progress.total_bytes / kProgressPushSteps, int64_t(1));
+        int64_t min_rate_change =
+                std::max(last.bytes_per_second / kProgressPushRateChange, int64_t(1));
+        bool rate_changed =
+                std::abs(progress.bytes_per_second - last.bytes_per_second) >= min_rate_change ||
+                (progress.eta_ms < 0) != (last.eta_ms < 0);
+        auto now = std::chrono::steady_clock::now();
+        bool heartbeat = progress.status == STATUS_WORKING && now - last_sent >= kProgressHeartbeat;
+        if (!new_step && !rate_changed && !heartbeat && progress.status == last.status &&
+            progress.io_path == last.io_path &&
+            progress.bytes_processed - last.bytes_processed < min_advance) {
+            continue;
+        }
+
+        // Don't hold the lock across binder calls. They are oneway, so a slow
+        // client cannot hold up the others.
+        auto listeners = progress_listeners_;
+        lock.unlock();
+        std::vector<sp<IGsiProgressListener>> unreachable;
+        for (const auto& listener : listeners) {
+            if (!listener->onProgress(progress).isOk()) {
+                unreachable.emplace_back(listener);
+            }
+        }
+        lock.lock();
+        for (const auto& listener : unreachable) {
+            auto binder = IInterface::asBinder(listener);
+            if (RemoveProgressListener(binder.get())) {
+                LOG(INFO) << "dropping unreachable progress listener";
+                if (binder->remoteBinder()) {
+                    binder->unlinkToDeath(this);
+                }
+            }
+        }
+
+        last = progress;
+        last_sent = now;
+        sent = true;
+    }
+    notifier_running_ = false;
+}
+
+binder::Status GsiService::getLastInstallReport(GsiInstallReport* _aidl_return) {
+    ENFORCE_SYSTEM_OR_SHELL;
+    *_aidl_return = install_report_.Get();
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::CheckUid(AccessLevel level) {
+    std::vector<uid_t> allowed_uids{AID_ROOT, AID_SYSTEM};
+    if (level == AccessLevel::SystemOrShell) {
+        allowed_uids.push_back(AID_SHELL);
+    }
+
+    uid_t uid = IPCThreadState::self()->getCallingUid();
+    for (const auto& allowed_uid : allowed_uids) {
+        if (allowed_uid == uid) {
+            return binder::Status::ok();
+        }
+    }
+
+    auto message = StringPrintf("UID %d is not allowed", uid);
+    return binder::Status::fromExceptionCode(binder::Status::EX_SECURITY,
+                                             String8(message.c_str()));
+}
+
+int GsiService::GetBootStatus() {
+    if (!IsGsiInstalled()) {
+        return BOOT_STATUS_NOT_INSTALLED;
+    }
+
+    std::string boot_key;
+    if (!GetInstallStatus(&boot_key)) {
+        PLOG(ERROR) << "read " << kGsiInstallStatusFile;
+        return BOOT_STATUS_NOT_INSTALLED;
+    }
+
+    bool single_boot = !access(kGsiOneShotBootFile, F_OK);
+
+    if (boot_key == kInstallStatusWipe) {
+        // This overrides all other statuses.
+        return BOOT_STATUS_WILL_WIPE;
+    } else if (boot_key == kInstallStatusDisabled) {
+        // A single-boot GSI will have a "disabled" status, because it's
+        // disabled immediately upon reading the one_shot_boot file. However,
+        // we still want to return SINGLE_BOOT, because it makes the
+        // transition clearer to the user.
+        if (single_boot) {
+            return BOOT_STATUS_SINGLE_BOOT;
+        } else {
+            return BOOT_STATUS_DISABLED;
+        }
+    } else if (single_boot) {
+        return BOOT_STATUS_SINGLE_BOOT;
+    } else {
+        return BOOT_STATUS_ENABLED;
+    }
+}
+
+void GsiService::PostInstallCleanup() {
+    // This must be closed before unmapping partitions.
+    system_writer_ = nullptr;
+
+    const auto& dm = DeviceMapper::Instance();
+    if (dm.GetState("userdata_gsi") != DmDeviceState::INVALID) {
+        DestroyLogicalPartition("userdata_gsi", kDmTimeout);
+    }
+    if (dm.GetState("system_gsi") != DmDeviceState::INVALID) {
+        DestroyLogicalPartition("system_gsi", kDmTimeout);
+    }
+
+    UnmapAshmem();
+    sparse_decoder_ = nullptr;
+    decompressor_ = nullptr;
+    image_hasher_ = nullptr;
+
+    installing_ = false;
+    partitions_ .clear();
+}
+
+static bool IsExternalStoragePath(const std::string& path) {
+    if (!android::base::StartsWith(path, "/mnt/media_rw/")) {
+        return false;
+    }
+    unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW));
+    if (fd < 0) {
+        PLOG(ERROR) << "open failed: " << path;
+        return false;
+    }
+    struct statfs info;
+    if (fstatfs(fd, &info)) {
+        PLOG(ERROR) << "statfs failed: " << path;
+        return false;
+    }
+    LOG(ERROR) << "fs type: " << info.f_type;
+    return info.f_type == MSDOS_SUPER_MAGIC;
+}
+
+int GsiService::ValidateInstallParams(GsiInstallParams* params) {
+    // If no install path was specified, use the default path. We also allow
+    // specifying the top-level folder, and then we choose the correct location
+    // underneath.
+    if (params->installDir.empty() || params->installDir == "/data/gsi") {
+        params->installDir = kDefaultGsiImageFolder;
+    }
+
+    // Normalize the path and add a trailing slash.
+    std::string origInstallDir = params->installDir;
+    if (!android::base::Realpath(origInstallDir, &params->installDir)) {
+        PLOG(ERROR) << "realpath failed: " << origInstallDir;
+        return INSTALL_ERROR_GENERIC;
+    }
+    // Ensure the path ends in / for consistency. Even though GetImagePath()
+    // does this already, we want it to appear this way in install_dir.
+    if (!android::base::EndsWith(params->installDir, "/")) {
+        params->installDir += "/";
+    }
+
+    // Currently, we can only install to /data/gsi/ or external storage.
+    if (IsExternalStoragePath(params->installDir)) {
+        Fstab fstab;
+        if (!ReadDefaultFstab(&fstab)) {
+            LOG(ERROR) << "cannot read default fstab";
+            return INSTALL_ERROR_GENERIC;
+        }
+        FstabEntry* system = GetEntryForMountPoint(&fstab, "/system");
+        if (!system) {
+            LOG(ERROR) << "cannot find /system fstab entry";
+            return INSTALL_ERROR_GENERIC;
+        }
+        if (fs_mgr_verity_is_check_at_most_once(*system)) {
+            LOG(ERROR) << "cannot install GSIs to external media if verity uses check_at_most_once";
+            return INSTALL_ERROR_GENERIC;
+        }
+    } else if (params->installDir != kDefaultGsiImageFolder) {
+        LOG(ERROR) << "cannot install GSI to " << params->installDir;
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    if (params->gsiSize % LP_SECTOR_SIZE) {
+        LOG(ERROR) << "GSI size " << params->gsiSize << " is not a multiple of " << LP_SECTOR_SIZE;
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (params->userdataSize % LP_SECTOR_SIZE) {
+        LOG(ERROR) << "userdata size " << params->userdataSize << " is not a multiple of "
                    << LP_SECTOR_SIZE;
         return INSTALL_ERROR_GENERIC;
     }
+    if (params->ioBufferSize < 0 || params->ioBufferSize > kMaxIoBufferSize) {
+        LOG(ERROR) << "I/O buffer size " << params->ioBufferSize << " must be between 0 and "
+                   << kMaxIoBufferSize;
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (params->compression < COMPRESSION_NONE || params->compression > COMPRESSION_ZSTD) {
+        LOG(ERROR) << "unknown compression type " << params->compression;
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (!params->expectedDigest.empty()) {
+        params->expectedDigest = android::base::Trim(params->expectedDigest);
+        std::transform(params->expectedDigest.begin(), params->expectedDigest.end(),
+                       params->expectedDigest.begin(), ::tolower);
+        if (params->expectedDigest.size() != 2 * SHA256_DIGEST_LENGTH ||
+            params->expectedDigest.find_first_not_of("0123456789abcdef") != std::string::npos) {
+            LOG(ERROR) << "expected digest is not a SHA-256 digest in hex: "
+                       << params->expectedDigest;
+            return INSTALL_ERROR_GENERIC;
+        }
+    }
     return INSTALL_OK;
 }
 
@@ -499,18 +1089,45 @@ int GsiService::StartInstall(const GsiInstallParams& params) {
     gsi_size_ = params.gsiSize;
     userdata_size_ = (params.userdataSize) ? params.userdataSize : kDefaultUserdataSize;
     wipe_userdata_ = params.wipeUserdata;
+    io_buffer_size_ = params.ioBufferSize;
     can_use_devicemapper_ = false;
     gsi_bytes_written_ = 0;
+    gsi_checksum_ = crc32(0, nullptr, 0);
+    gsi_checksum_bytes_ = 0;
+    last_checkpoint_ = 0;
+    gsi_bytes_zeroed_ = 0;
+    expected_digest_ = params.expectedDigest;
+    image_hasher_ = std::make_unique<ImageHasher>(!expected_digest_.empty());
+    image_digest_.clear();
+    image_stripe_digest_.clear();
+    stripe_digest_valid_ = true;
+    image_format_known_ = false;
+    sparse_decoder_ = nullptr;
+    decompressor_ = nullptr;
+    if (params.compression != COMPRESSION_NONE) {
+        decompressor_ = Decompressor::Create(params.compression);
+        if (!decompressor_) {
+            return INSTALL_ERROR_GENERIC;
+        }
+    }
     install_dir_ = params.installDir;
 
     userdata_gsi_path_ = GetImagePath(install_dir_, "userdata_gsi");
     system_gsi_path_ = GetImagePath(install_dir_, "system_gsi");
 
+    // A new install replaces anything left by an interrupted one.
+    android::base::RemoveFileIfExists(kGsiInstallCheckpointFile);
+    android::base::RemoveFileIfExists(kGsiImageDigestFile);
+    android::base::RemoveFileIfExists(GetManifestPath(install_dir_, "system_gsi"));
+
     // Only rm userdata_gsi if one didn't already exist.
     wipe_userdata_on_failure_ = wipe_userdata_ || access(userdata_gsi_path_.c_str(), F_OK);
 
-    if (int status = PerformSanityChecks()) {
-        return status;
+    {
+        InstallReport::Phase phase(&install_report_, "PerformSanityChecks");
+        if (int status = PerformSanityChecks()) {
+            return status;
+        }
     }
     if (int status = PreallocateFiles()) {
         return status;
@@ -518,18 +1135,158 @@ int GsiService::StartInstall(const GsiInstallParams& params) {
     if (int status = DetermineReadWriteMethod()) {
         return status;
     }
-    if (!FormatUserdata()) {
-        return INSTALL_ERROR_GENERIC;
+    {
+        InstallReport::Phase phase(&install_report_, "FormatUserdata");
+        if (!FormatUserdata()) {
+            return INSTALL_ERROR_GENERIC;
+        }
     }
 
     // Map system_gsi so we can write to it.
-    system_writer_ = OpenPartition("system_gsi");
+    system_writer_ = OpenMeasuredPartition("system_gsi");
     if (!system_writer_) {
         return INSTALL_ERROR_GENERIC;
     }
+
+    // Even with no image data written, a checkpoint saves having to
+    // allocate the images again.
+    WriteCheckpoint();
     return INSTALL_OK;
 }
 
+int64_t GsiService::ResumeInstall(const GsiInstallParams& params) {
+    InstallCheckpoint checkpoint;
+    if (!ReadInstallCheckpoint(&checkpoint)) {
+        LOG(ERROR) << "no interrupted installation to resume";
+        return -1;
+    }
+    if (checkpoint.install_dir != params.installDir ||
+        checkpoint.gsi_size != static_cast<uint64_t>(params.gsiSize)) {
+        LOG(ERROR) << "install parameters do not match the interrupted installation";
+        return -1;
+    }
+
+    installing_ = true;
+    userdata_block_size_ = 0;
+    system_block_size_ = 0;
+    gsi_size_ = checkpoint.gsi_size;
+    userdata_size_ = checkpoint.userdata_size;
+    wipe_userdata_ = false;
+    io_buffer_size_ = params.ioBufferSize;
+    can_use_devicemapper_ = false;
+    install_dir_ = params.installDir;
+    userdata_gsi_path_ = GetImagePath(install_dir_, "userdata_gsi");
+    system_gsi_path_ = GetImagePath(install_dir_, "system_gsi");
+    wipe_userdata_on_failure_ = checkpoint.wipe_userdata_on_failure;
+
+    // Reopen the images exactly as they were allocated.
+    std::pair<std::string, uint64_t> images[] = {
+            {"userdata_gsi", userdata_size_},
+            {"system_gsi", gsi_size_},
+    };
+    for (const auto& [name, size] : images) {
+        int error;
+        auto writer = CreateFiemapWriter(GetImagePath(install_dir_, name), 0, &error);
+        if (!writer) {
+            return -1;
+        }
+        if (!writer->HasPinnedExtents()) {
+            LOG(ERROR) << name << " no longer has pinned extents";
+            return -1;
+        }
+        if (name == "system_gsi") {
+            system_block_size_ = writer->block_size();
+        } else {
+            userdata_block_size_ = writer->block_size();
+        }
+        Image image = {
+                .writer = std::move(writer),
+                .actual_size = size,
+        };
+        partitions_.emplace(std::make_pair(name, std::move(image)));
+    }
+
+    if (DetermineReadWriteMethod()) {
+        return -1;
+    }
+    metadata_ = CreateMetadata();
+    if (!metadata_) {
+        return -1;
+    }
+    system_writer_ = OpenMeasuredPartition("system_gsi");
+    if (!system_writer_) {
+        return -1;
+    }
+
+    uint64_t offset = checkpoint.bytes_written;
+    uint32_t checksum = checkpoint.checksum;
+    if (offset && !can_use_devicemapper_) {
+        // SplitFiemap can only write sequentially.
+        LOG(INFO) << "cannot seek without device-mapper, resuming from the start of the image";
+        offset = 0;
+    }
+    if (params.compression != COMPRESSION_NONE) {
+        // There's no way to start decompressing in the middle of a stream.
+        if (offset) {
+            LOG(INFO) << "cannot seek in a compressed stream, resuming from the start of the image";
+            offset = 0;
+        }
+        decompressor_ = Decompressor::Create(params.compression);
+        if (!decompressor_) {
+            return -1;
+        }
+    }
+    expected_digest_ = params.expectedDigest;
+    if (offset && !checkpoint.has_checksum && !expected_digest_.empty()) {
+        // The spliced prefix was never hashed, and can't be checked first.
+        LOG(INFO) << "image digest requested, resuming from the start of the image";
+        offset = 0;
+    }
+    image_hasher_ = std::make_unique<ImageHasher>(!expected_digest_.empty());
+    image_digest_.clear();
+    image_stripe_digest_.clear();
+    stripe_digest_valid_ = true;
+
+    if (offset && checkpoint.has_checksum) {
+        // Make sure the data on disk is what we think we wrote. This also
+        // hashes the prefix.
+        uint32_t actual = crc32(0, nullptr, 0);
+        if (!ChecksumSystemImage(0, offset, true, &actual)) {
+            return -1;
+        }
+        if (actual != checksum) {
+            LOG(WARNING) << "checksum mismatch for the first " << offset
+                         << " bytes of the image, resuming from the start of the image";
+            offset = 0;
+        }
+    }
+    if (offset && !system_writer_->Seek(offset)) {
+        LOG(ERROR) << "could not seek to offset " << offset << " in " << system_gsi_path_;
+        return -1;
+    }
+    if (!offset) {
+        checksum = crc32(0, nullptr, 0);
+        image_hasher_ = std::make_unique<ImageHasher>(!expected_digest_.empty());
+    } else if (!checkpoint.has_checksum) {
+        image_hasher_ = nullptr;
+    }
+
+    gsi_bytes_written_ = offset;
+    gsi_bytes_zeroed_ = 0;
+    gsi_checksum_ = checksum;
+    // Without a checksum the prefix can't be read back either, since the CRC
+    // has to start from offset 0.
+    gsi_checksum_bytes_ = (!offset || checkpoint.has_checksum) ? offset : UINT64_MAX;
+    last_checkpoint_ = offset;
+    // Checkpoints are not written while decoding a sparse image, so any
+    // data after offset 0 is a raw image.
+    image_format_known_ = (offset != 0);
+    sparse_decoder_ = nullptr;
+
+    LOG(INFO) << "resuming installation at offset " << offset << " of " << gsi_size_;
+    return offset;
+}
+
 int GsiService::DetermineReadWriteMethod() {
     // If there is a device-mapper node wrapping the block device, then we're
     // able to create another node around it; the dm layer does not carry the
@@ -618,18 +1375,55 @@ int GsiService::PreallocateFiles() {
     }
     SplitFiemap::RemoveSplitFiles(system_gsi_path_);
 
-    // TODO: trigger GC from fiemap writer.
+    // Create fallocated files. The images are allocated one after the other,
+    // not in parallel: on f2fs, pinned sections handed out to both files at
+    // once interleave, fragmenting both images. Each is its own step.
+    uint64_t userdata_bytes = 0;
+    if (wipe_userdata_ || access(userdata_gsi_path_.c_str(), F_OK)) {
+        userdata_bytes = userdata_size_;
+    } else if (userdata_size_) {
+        // An existing image that is too small is grown in place.
+        auto existing = SplitFiemap::Open(userdata_gsi_path_);
+        if (existing && existing->size() < userdata_size_) {
+            userdata_bytes = userdata_size_ - existing->size();
+        }
+    }
+    StartAsyncOperation("create userdata", userdata_bytes);
 
-    // Create fallocated files.
-    if (int status = PreallocateUserdata()) {
-        return status;
+    Image userdata_image;
+    bool userdata_created;
+    {
+        InstallReport::Phase phase(&install_report_, "PreallocateUserdata");
+        if (int status = PreallocateUserdata(&userdata_image, &userdata_created)) {
+            return status;
+        }
     }
-    if (int status = PreallocateSystem()) {
-        return status;
+    if (userdata_created) {
+        // Signal that we need to reformat userdata.
+        wipe_userdata_ = true;
+    }
+    userdata_size_ = userdata_image.actual_size;
+    userdata_block_size_ = userdata_image.writer->block_size();
+    UpdateProgress(STATUS_COMPLETE, 0);
+
+    StartAsyncOperation("create system", gsi_size_);
+
+    Image system_image;
+    {
+        InstallReport::Phase phase(&install_report_, "PreallocateSystem");
+        if (int status = PreallocateSystem(&system_image)) {
+            return status;
+        }
     }
+    system_block_size_ = system_image.writer->block_size();
+    partitions_.emplace(std::make_pair("userdata_gsi", std::move(userdata_image)));
+    partitions_.emplace(std::make_pair("system_gsi", std::move(system_image)));
 
     // Save the extent information in liblp.
-    metadata_ = CreateMetadata();
+    {
+        InstallReport::Phase phase(&install_report_, "CreateMetadata");
+        metadata_ = CreateMetadata();
+    }
     if (!metadata_) {
         return INSTALL_ERROR_GENERIC;
     }
@@ -638,18 +1432,19 @@ int GsiService::PreallocateFiles() {
     return INSTALL_OK;
 }
 
-int GsiService::PreallocateUserdata() {
+// Create userdata_gsi, or reuse the existing one. |created| is set if the
+// image was created and needs to be formatted.
+int GsiService::PreallocateUserdata(Image* image, bool* created) {
     int error;
+    uint64_t size = userdata_size_;
     std::unique_ptr<SplitFiemap> userdata_image;
-    if (wipe_userdata_ || access(userdata_gsi_path_.c_str(), F_OK)) {
-        StartAsyncOperation("create userdata", userdata_size_);
-        userdata_image = CreateFiemapWriter(userdata_gsi_path_, userdata_size_, &error);
+    *created = wipe_userdata_ || access(userdata_gsi_path_.c_str(), F_OK);
+    if (*created) {
+        userdata_image = CreateFiemapWriter(userdata_gsi_path_, userdata_size_, &error, true);
         if (!userdata_image) {
             LOG(ERROR) << "Could not create userdata image: " << userdata_gsi_path_;
             return error;
         }
-        // Signal that we need to reformat userdata.
-        wipe_userdata_ = true;
     } else {
         userdata_image = CreateFiemapWriter(userdata_gsi_path_, 0, &error);
         if (!userdata_image) {
@@ -657,51 +1452,300 @@ int GsiService::PreallocateUserdata() {
             return error;
         }
         if (userdata_size_ && userdata_image->size() < userdata_size_) {
-            // :TODO: need to fallocate more blocks and resizefs.
+            // Add space after the existing extents. userdata is formatted
+            // again on first boot, so there is no filesystem to resize.
+            userdata_image = nullptr;
+            userdata_image = GrowFiemapWriter(userdata_gsi_path_, userdata_size_, &error, true);
+            if (!userdata_image) {
+                LOG(ERROR) << "Could not grow userdata image: " << userdata_gsi_path_;
+                return error;
+            }
         }
-        userdata_size_ = userdata_image->size();
+        size = userdata_image->size();
     }
 
-    userdata_block_size_ = userdata_image->block_size();
-
-    Image image = {
-            .writer = std::move(userdata_image),
-            .actual_size = userdata_size_,
-    };
-    partitions_.emplace(std::make_pair("userdata_gsi", std::move(image)));
+    image->writer = std::move(userdata_image);
+    image->actual_size = size;
     return INSTALL_OK;
 }
 
-int GsiService::PreallocateSystem() {
-    StartAsyncOperation("create system", gsi_size_);
-
+int GsiService::PreallocateSystem(Image* image) {
     int error;
-    auto system_image = CreateFiemapWriter(system_gsi_path_, gsi_size_, &error);
+    auto system_image = CreateFiemapWriter(system_gsi_path_, gsi_size_, &error, true);
     if (!system_image) {
         return error;
     }
 
-    system_block_size_ = system_image->block_size();
-
-    Image image = {
-            .writer = std::move(system_image),
-            .actual_size = gsi_size_,
-    };
-    partitions_.emplace(std::make_pair("system_gsi", std::move(image)));
+    image->writer = std::move(system_image);
+    image->actual_size = gsi_size_;
     return INSTALL_OK;
 }
 
-std::unique_ptr<SplitFiemap> GsiService::CreateFiemapWriter(const std::string& path,
-                                                            uint64_t size, int* error) {
-    bool create = (size != 0);
+// A run of physically contiguous sectors.
+struct SectorRun {
+    uint64_t physical_sector;
+    uint64_t num_sectors;
+};
 
-    std::function<bool(uint64_t, uint64_t)> progress;
-    if (create) {
-        // TODO: allow cancelling inside cancelGsiInstall.
-        progress = [this](uint64_t bytes, uint64_t /* total */) -> bool {
-            UpdateProgress(STATUS_WORKING, bytes);
-            if (should_abort_) return false;
-            return true;
+// Merge physically adjacent extents, so that each run becomes a single
+// dm-linear target. Adjacent extents are common: FIEMAP splits extents at the
+// filesystem's maximum extent length, and consecutive split files are often
+// allocated back to back.
+static bool CoalesceExtents(const std::vector<struct fiemap_extent>& extents,
+                            std::vector<SectorRun>* runs) {
+    for (const auto& extent : extents) {
+        // :TODO: block size check for length, not sector size
+        if (extent.fe_length % LP_SECTOR_SIZE != 0) {
+            LOG(ERROR) << "Extent is not sector-aligned: " << extent.fe_length;
+            return false;
+        }
+        if (extent.fe_physical % LP_SECTOR_SIZE != 0) {
+            LOG(ERROR) << "Extent physical sector is not sector-aligned: " << extent.fe_physical;
+            return false;
+        }
+
+        uint64_t physical_sector = extent.fe_physical / LP_SECTOR_SIZE;
+        uint64_t num_sectors = extent.fe_length / LP_SECTOR_SIZE;
+        if (!runs->empty() &&
+            runs->back().physical_sector + runs->back().num_sectors == physical_sector) {
+            runs->back().num_sectors += num_sectors;
+        } else {
+            runs->push_back({physical_sector, num_sectors});
+        }
+    }
+    return true;
+}
+
+// Allocate a pinned file of |size| bytes at |path|, without writing more of
+// it than the filesystem needs. |progress| is called with the number of
+// bytes done so far. |needs_zeroes| is set if the file still has to be
+// written with ZeroPiece() before device-mapper can use it.
+static bool AllocatePiece(const std::string& path, uint64_t size,
+                          const std::function<bool(uint64_t)>& progress, bool* needs_zeroes) {
+    *needs_zeroes = false;
+    auto slow_path = [&]() -> bool {
+        android::base::RemoveFileIfExists(path);
+        auto on_progress = [&](uint64_t bytes, uint64_t /* total */) -> bool {
+            return progress(bytes);
+        };
+        return FiemapWriter::Open(path, size, true, std::move(on_progress)) != nullptr;
+    };
+
+    android::base::RemoveFileIfExists(path);
+    unique_fd fd(open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << path;
+        return false;
+    }
+    struct statfs info;
+    if (fstatfs(fd, &info)) {
+        PLOG(ERROR) << "statfs " << path;
+        return false;
+    }
+
+    if (info.f_type == F2FS_SUPER_MAGIC) {
+        // A file pinned before fallocate() gets real block addresses at once,
+        // so there is nothing to write.
+        __u32 pin = 1;
+        if (ioctl(fd, F2FS_IOC_SET_PIN_FILE, &pin)) {
+            PLOG(INFO) << "cannot pin " << path << " before allocating it";
+            fd.reset();
+            return slow_path();
+        }
+    } else if (info.f_type == EXT4_SUPER_MAGIC) {
+        // ext4 leaves fallocated extents unwritten until data is written to
+        // them through the filesystem, which writes through device-mapper
+        // are not.
+        *needs_zeroes = true;
+    } else {
+        fd.reset();
+        return slow_path();
+    }
+
+    for (uint64_t offset = 0; offset < size;) {
+        uint64_t bytes = std::min(size - offset, kFallocateBatchSize);
+        if (fallocate(fd, 0, offset, bytes)) {
+            PLOG(ERROR) << "fallocate " << path;
+            return false;
+        }
+        offset += bytes;
+        if (!*needs_zeroes && !progress(offset)) {
+            return false;
+        }
+    }
+    if (fsync(fd)) {
+        PLOG(ERROR) << "fsync " << path;
+        return false;
+    }
+    return true;
+}
+
+// Write zeroes over a piece allocated by AllocatePiece().
+static bool ZeroPiece(const std::string& path, uint64_t size,
+                      const std::function<bool(uint64_t)>& progress) {
+    static const std::vector<char> kZeroes(kAllocateZeroSize);
+
+    unique_fd fd(open(path.c_str(), O_WRONLY | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << path;
+        return false;
+    }
+    for (uint64_t offset = 0; offset < size;) {
+        size_t bytes = std::min(size - offset, static_cast<uint64_t>(kZeroes.size()));
+        if (!android::base::WriteFully(fd, kZeroes.data(), bytes)) {
+            PLOG(ERROR) << "write " << path;
+            return false;
+        }
+        offset += bytes;
+        if (!progress(offset)) {
+            return false;
+        }
+    }
+    if (fsync(fd)) {
+        PLOG(ERROR) << "fsync " << path;
+        return false;
+    }
+    return true;
+}
+
+// Allocate pinned pieces of |sizes| bytes for the split image at |path|,
+// numbered from |first_index|. |progress| is called with the number of bytes
+// allocated so far. On failure, the pieces created so far are removed.
+//
+// The pieces are allocated one at a time: f2fs hands out pinned space a
+// section at a time, so concurrent fallocate() calls would interleave their
+// sections and fragment every piece. Only the zeroes that ext4 needs are
+// written on several threads.
+static bool AllocatePieces(const std::string& path, size_t first_index,
+                           const std::vector<uint64_t>& sizes,
+                           const std::function<bool(uint64_t)>& progress,
+                           std::vector<std::string>* files) {
+    for (size_t i = 0; i < sizes.size(); i++) {
+        files->emplace_back(StringPrintf("%s.%04zu", path.c_str(), first_index + i));
+    }
+    auto fail = [files]() -> bool {
+        for (const auto& file : *files) {
+            android::base::RemoveFileIfExists(file);
+        }
+        files->clear();
+        return false;
+    };
+
+    std::atomic<uint64_t> allocated = 0;
+    std::atomic<bool> failed = false;
+    std::vector<size_t> to_zero;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        uint64_t done = 0;
+        auto piece_progress = [&](uint64_t bytes) -> bool {
+            uint64_t total = allocated += bytes - done;
+            done = bytes;
+            return progress(total);
+        };
+        bool needs_zeroes;
+        if (!AllocatePiece((*files)[i], sizes[i], piece_progress, &needs_zeroes)) {
+            LOG(ERROR) << "could not allocate " << (*files)[i];
+            return fail();
+        }
+        if (needs_zeroes) {
+            to_zero.emplace_back(i);
+        }
+    }
+
+    std::atomic<size_t> next_piece = 0;
+    auto worker = [&]() -> void {
+        size_t n;
+        while (!failed && (n = next_piece++) < to_zero.size()) {
+            size_t i = to_zero[n];
+            uint64_t done = 0;
+            auto piece_progress = [&](uint64_t bytes) -> bool {
+                uint64_t total = allocated += bytes - done;
+                done = bytes;
+                return !failed && progress(total);
+            };
+            if (!ZeroPiece((*files)[i], sizes[i], piece_progress)) {
+                LOG(ERROR) << "could not zero " << (*files)[i];
+                failed = true;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::min(static_cast<size_t>(kAllocateThreads), to_zero.size()); i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (failed) {
+        return fail();
+    }
+
+    // Check the result the same way an existing piece is checked.
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (!FiemapWriter::Open((*files)[i], sizes[i], false)) {
+            LOG(ERROR) << "allocated piece " << (*files)[i] << " is not usable";
+            return fail();
+        }
+    }
+    return true;
+}
+
+// Create a split image of |size| bytes at |path|. When the filesystem can
+// describe its free space, the pieces are sized to fit its largest free runs,
+// so that each piece has a chance of being a single extent.
+static std::unique_ptr<SplitFiemap> CreateSplitImage(
+        const std::string& path, uint64_t size,
+        const std::function<bool(uint64_t, uint64_t)>& progress) {
+    auto dir = android::base::Dirname(path);
+    struct statfs info;
+    if (statfs(dir.c_str(), &info)) {
+        PLOG(ERROR) << "statfs " << dir;
+        return nullptr;
+    }
+    uint64_t max_piece_size = size;
+    if (info.f_type == MSDOS_SUPER_MAGIC) {
+        max_piece_size = kMaxFatPieceSize;
+    }
+    std::vector<uint64_t> runs;
+    if (!GetFreeRuns(dir, &runs)) {
+        runs.clear();
+    }
+    auto pieces = PlanImagePieces(runs, size, info.f_bsize, max_piece_size);
+    if (!runs.empty()) {
+        LOG(INFO) << "allocating " << path << " as " << pieces.size()
+                  << " pieces, largest free run is " << runs[0] << " bytes";
+    }
+
+    std::vector<std::string> files;
+    auto piece_progress = [&](uint64_t bytes) -> bool {
+        return !progress || progress(bytes, size);
+    };
+    if (!AllocatePieces(path, 0, pieces, piece_progress, &files)) {
+        return nullptr;
+    }
+    std::string list;
+    for (const auto& file : files) {
+        list += android::base::Basename(file) + "\n";
+    }
+    if (!WriteFileAtomically(path, list)) {
+        for (const auto& file : files) {
+            android::base::RemoveFileIfExists(file);
+        }
+        return nullptr;
+    }
+    return SplitFiemap::Open(path);
+}
+
+std::unique_ptr<SplitFiemap> GsiService::CreateFiemapWriter(const std::string& path, uint64_t size,
+                                                            int* error, bool report_progress) {
+    bool create = (size != 0);
+
+    std::function<bool(uint64_t, uint64_t)> progress;
+    if (create) {
+        progress = [this, report_progress](uint64_t bytes, uint64_t /* total */) -> bool {
+            if (report_progress) {
+                UpdateProgress(STATUS_WORKING, bytes);
+            }
+            return !should_abort_;
         };
     }
 
@@ -709,7 +1753,7 @@ std::unique_ptr<SplitFiemap> GsiService::CreateFiemapWriter(const std::string& p
     if (!size) {
         file = SplitFiemap::Open(path);
     } else {
-        file = SplitFiemap::Create(path, size, 0, std::move(progress));
+        file = CreateSplitImage(path, size, progress);
     }
     if (!file) {
         LOG(ERROR) << "failed to create or open " << path;
@@ -717,7 +1761,49 @@ std::unique_ptr<SplitFiemap> GsiService::CreateFiemapWriter(const std::string& p
         return nullptr;
     }
 
-    uint64_t extents = file->extents().size();
+    // What matters is the size of the dm-linear table, so adjacent extents
+    // only count once.
+    auto count_extents = [](SplitFiemap* file) -> uint64_t {
+        std::vector<SectorRun> runs;
+        if (!CoalesceExtents(file->extents(), &runs)) {
+            return file->extents().size();
+        }
+        return runs.size();
+    };
+    uint64_t extents = count_extents(file.get());
+    if (create && extents > kMaximumExtents) {
+        // Gather free space into larger runs and try once more, with pieces
+        // planned against the new layout.
+        LOG(WARNING) << "file " << path << " has " << extents
+                     << " extents, compacting free space and retrying";
+        file = nullptr;
+        SplitFiemap::RemoveSplitFiles(path);
+
+        // Compaction is its own step, after which the interrupted one
+        // starts over.
+        const std::string* step = progress_step_.load(std::memory_order_relaxed);
+        int64_t step_total = progress_total_bytes_.load(std::memory_order_relaxed);
+        StartAsyncOperation("compact free space", kMaxCompactRounds);
+        auto compact_progress = [this](uint64_t rounds) -> bool {
+            UpdateProgress(STATUS_WORKING, rounds);
+            return !should_abort_;
+        };
+        if (!CompactFreeSpace(android::base::Dirname(path), compact_progress)) {
+            *error = INSTALL_ERROR_GENERIC;
+            return nullptr;
+        }
+        UpdateProgress(STATUS_COMPLETE, 0);
+        if (step) {
+            StartAsyncOperation(*step, step_total);
+        }
+        file = CreateSplitImage(path, size, progress);
+        if (!file) {
+            LOG(ERROR) << "failed to create " << path;
+            *error = INSTALL_ERROR_GENERIC;
+            return nullptr;
+        }
+        extents = count_extents(file.get());
+    }
     if (extents > kMaximumExtents) {
         LOG(ERROR) << "file " << path << " has too many extents: " << extents;
         *error = INSTALL_ERROR_FILE_SYSTEM_CLUTTERED;
@@ -726,13 +1812,202 @@ std::unique_ptr<SplitFiemap> GsiService::CreateFiemapWriter(const std::string& p
     return file;
 }
 
+// Grow a split image to at least |size| bytes by adding pinned pieces after
+// the existing ones. The existing pieces, and the data in them, are not
+// touched.
+std::unique_ptr<SplitFiemap> GsiService::GrowFiemapWriter(const std::string& path, uint64_t size,
+                                                          int* error, bool report_progress) {
+    *error = INSTALL_ERROR_GENERIC;
+
+    std::vector<std::string> files;
+    if (!SplitFiemap::GetSplitFileList(path, &files)) {
+        LOG(ERROR) << "could not read the piece list of " << path;
+        return nullptr;
+    }
+    uint64_t current_size, block_size;
+    {
+        auto file = SplitFiemap::Open(path);
+        if (!file) {
+            LOG(ERROR) << "failed to open " << path;
+            return nullptr;
+        }
+        current_size = file->size();
+        block_size = file->block_size();
+    }
+    if (current_size >= size) {
+        return CreateFiemapWriter(path, 0, error);
+    }
+    uint64_t needed = ((size - current_size + block_size - 1) / block_size) * block_size;
+
+    uint64_t max_piece_size = needed;
+    struct statfs info;
+    if (statfs(android::base::Dirname(path).c_str(), &info)) {
+        PLOG(ERROR) << "statfs failed: " << path;
+        return nullptr;
+    }
+    if (info.f_type == MSDOS_SUPER_MAGIC) {
+        max_piece_size = kMaxFatPieceSize;
+    }
+
+    // Allocate the new pieces first. The piece list is only updated once
+    // they all exist, so a failure leaves the image as it was.
+    std::vector<uint64_t> sizes;
+    for (uint64_t left = needed; left;) {
+        sizes.emplace_back(std::min(left, max_piece_size));
+        left -= sizes.back();
+    }
+    auto progress = [&](uint64_t bytes) -> bool {
+        if (report_progress) {
+            UpdateProgress(STATUS_WORKING, bytes);
+        }
+        return !should_abort_;
+    };
+    std::vector<std::string> new_files;
+    if (!AllocatePieces(path, files.size(), sizes, progress, &new_files)) {
+        return nullptr;
+    }
+    auto remove_new_files = [&new_files]() -> void {
+        for (const auto& file : new_files) {
+            android::base::RemoveFileIfExists(file);
+        }
+    };
+
+    std::string list;
+    for (const auto& file : files) {
+        list += android::base::Basename(file) + "\n";
+    }
+    for (const auto& file : new_files) {
+        list += android::base::Basename(file) + "\n";
+    }
+    if (!WriteFileAtomically(path, list)) {
+        remove_new_files();
+        return nullptr;
+    }
+    LOG(INFO) << "grew " << path << " from " << current_size << " to " << current_size + needed
+              << " bytes";
+    return CreateFiemapWriter(path, 0, error);
+}
+
+// Shrink a split image to |size| bytes, which must be a multiple of its block
+// size. Trailing pieces are deleted, and the piece that holds the new end is
+// truncated. Nothing may map the image past |size| any more: the steps are
+// ordered so that, if one fails, the piece list still names files that exist
+// and hold at least |size| bytes.
+static bool ShrinkSplitImage(const std::string& path, uint64_t size) {
+    std::vector<std::string> files;
+    if (!SplitFiemap::GetSplitFileList(path, &files)) {
+        LOG(ERROR) << "could not read the piece list of " << path;
+        return false;
+    }
+
+    uint64_t kept = 0;
+    size_t kept_files = 0;
+    // The piece holding the new end, and its new size.
+    std::string last_file;
+    uint64_t last_size = 0;
+    for (const auto& file : files) {
+        if (kept >= size) {
+            break;
+        }
+        struct stat s;
+        if (stat(file.c_str(), &s)) {
+            PLOG(ERROR) << "stat " << file;
+            return false;
+        }
+        uint64_t piece_size = s.st_size;
+        if (piece_size > size - kept) {
+            piece_size = size - kept;
+            last_file = file;
+            last_size = piece_size;
+        }
+        kept += piece_size;
+        kept_files++;
+    }
+    if (kept < size) {
+        LOG(ERROR) << path << " is smaller than " << size << " bytes";
+        return false;
+    }
+
+    // Drop the trailing pieces from the list before touching any file, so
+    // that the list never names a missing file.
+    std::string list;
+    for (size_t i = 0; i < kept_files; i++) {
+        list += android::base::Basename(files[i]) + "\n";
+    }
+    if (!WriteFileAtomically(path, list)) {
+        return false;
+    }
+    if (!last_file.empty() && truncate(last_file.c_str(), last_size)) {
+        PLOG(ERROR) << "truncate " << last_file;
+        return false;
+    }
+    for (size_t i = kept_files; i < files.size(); i++) {
+        if (!android::base::RemoveFileIfExists(files[i])) {
+            PLOG(ERROR) << "could not remove " << files[i];
+        }
+    }
+    LOG(INFO) << "shrank " << path << " to " << size << " bytes";
+    return true;
+}
+
+// Zero a range of a block device without sending it any data. Depending on
+// the device, the kernel offloads this or writes zeroed pages itself.
+static bool ZeroOut(int fd, uint64_t offset, uint64_t bytes, const std::string& path) {
+    uint64_t range[2] = {offset, bytes};
+    if (ioctl(fd, BLKZEROOUT, &range)) {
+        PLOG(ERROR) << "BLKZEROOUT failed: " << path;
+        return false;
+    }
+    return true;
+}
+
+bool GsiService::WriteHelper::Skip(uint64_t bytes) {
+    return WriteZeroes(bytes);
+}
+
+bool GsiService::WriteHelper::WriteFd(int fd, const void* data, uint64_t bytes,
+                                       int64_t offset) {
+    const char* pos = reinterpret_cast<const char*>(data);
+    while (bytes) {
+        auto start = InstallReport::Clock::now();
+        ssize_t n;
+        if (offset < 0) {
+            n = TEMP_FAILURE_RETRY(write(fd, pos, bytes));
+        } else {
+            n = TEMP_FAILURE_RETRY(pwrite64(fd, pos, bytes, offset));
+        }
+        ReportCall();
+        if (n <= 0) {
+            if (n == 0) errno = ENOSPC;
+            return false;
+        }
+        ReportWrite(n, InstallReport::Clock::now() - start);
+        pos += n;
+        bytes -= n;
+        if (offset >= 0) offset += n;
+    }
+    return true;
+}
+
+bool GsiService::WriteHelper::WriteZeroes(uint64_t bytes) {
+    static const std::vector<char> kZeroes(kMinDefaultIoBufferSize);
+    while (bytes) {
+        uint64_t to_write = std::min(bytes, static_cast<uint64_t>(kZeroes.size()));
+        if (!Write(kZeroes.data(), to_write)) {
+            return false;
+        }
+        bytes -= to_write;
+    }
+    return true;
+}
+
 // Write data through an fd.
 class FdWriter final : public GsiService::WriteHelper {
   public:
     FdWriter(const std::string& path, unique_fd&& fd) : path_(path), fd_(std::move(fd)) {}
 
     bool Write(const void* data, uint64_t bytes) override {
-        return android::base::WriteFully(fd_, data, bytes);
+        return WriteFd(fd_, data, bytes, -1);
     }
     bool Flush() override {
         if (fsync(fd_)) {
@@ -742,172 +2017,1885 @@ class FdWriter final : public GsiService::WriteHelper {
         return true;
     }
     uint64_t Size() override { return get_block_device_size(fd_); }
+    ssize_t Splice(int fd, size_t bytes) override {
+        auto start = InstallReport::Clock::now();
+        ssize_t rv = TEMP_FAILURE_RETRY(
+                splice(fd, nullptr, fd_, nullptr, bytes, SPLICE_F_MOVE | SPLICE_F_MORE));
+        ReportCall();
+        if (rv > 0) {
+            ReportWrite(rv, InstallReport::Clock::now() - start);
+        }
+        return rv;
+    }
+    bool Seek(uint64_t offset) override {
+        off64_t rv = lseek64(fd_, offset, SEEK_SET);
+        if (rv < 0) {
+            PLOG(ERROR) << "lseek failed: " << path_;
+            return false;
+        }
+        return static_cast<uint64_t>(rv) == offset;
+    }
+    bool Skip(uint64_t bytes) override {
+        if (lseek64(fd_, bytes, SEEK_CUR) < 0) {
+            PLOG(ERROR) << "lseek failed: " << path_;
+            return false;
+        }
+        return true;
+    }
+    bool WriteZeroes(uint64_t bytes) override {
+        off64_t offset = lseek64(fd_, 0, SEEK_CUR);
+        if (offset < 0) {
+            PLOG(ERROR) << "lseek failed: " << path_;
+            return false;
+        }
+        if (offset % kZeroOutAlignment || bytes % kZeroOutAlignment) {
+            return WriteHelper::WriteZeroes(bytes);
+        }
+        auto start = InstallReport::Clock::now();
+        bool ok = ZeroOut(fd_, offset, bytes, path_);
+        ReportCall();
+        if (!ok) {
+            return false;
+        }
+        ReportWrite(0, InstallReport::Clock::now() - start);
+        return Skip(bytes);
+    }
 
   private:
     std::string path_;
     unique_fd fd_;
 };
 
-// Write data through a SplitFiemap.
-class SplitFiemapWriter final : public GsiService::WriteHelper {
+// Write data to a block device through io_uring. Data is staged into a set of
+// aligned buffers which are written with O_DIRECT, so that several large
+// writes are in flight at once. A trailing partial block, which O_DIRECT
+// cannot write, goes through a second, buffered descriptor.
+class UringWriter final : public GsiService::WriteHelper {
   public:
-    explicit SplitFiemapWriter(SplitFiemap* writer) : writer_(writer) {}
+    static std::unique_ptr<UringWriter> Open(const std::string& image_path,
+                                             const std::string& device_path) {
+        static const int kOpenFlags = O_RDWR | O_NOFOLLOW | O_CLOEXEC;
+        unique_fd direct_fd(open(device_path.c_str(), kOpenFlags | O_DIRECT));
+        if (direct_fd < 0) {
+            PLOG(INFO) << "could not open " << device_path << " with O_DIRECT";
+            return nullptr;
+        }
+        unique_fd fd(open(device_path.c_str(), kOpenFlags));
+        if (fd < 0) {
+            PLOG(ERROR) << "could not open " << device_path;
+            return nullptr;
+        }
+
+        std::unique_ptr<UringWriter> writer(
+                new UringWriter(image_path, std::move(direct_fd), std::move(fd)));
+        if (!writer->Init()) {
+            return nullptr;
+        }
+        return writer;
+    }
+
+    ~UringWriter() override {
+        // Make sure everything handed to Write() reaches the device, the same
+        // as it would with a plain write().
+        Drain();
+        if (ring_initialized_) {
+            io_uring_queue_exit(&ring_);
+        }
+    }
 
     bool Write(const void* data, uint64_t bytes) override {
-        return writer_->Write(data, bytes);
+        const char* pos = reinterpret_cast<const char*>(data);
+
+        // A previous Flush() may have left us at an unaligned offset. Get
+        // back to a block boundary with a buffered write.
+        if (offset_ % kUringAlignment && bytes) {
+            uint64_t to_write = std::min(bytes, kUringAlignment - (offset_ % kUringAlignment));
+            if (!WriteBuffered(pos, to_write)) {
+                return false;
+            }
+            pos += to_write;
+            bytes -= to_write;
+        }
+
+        while (bytes) {
+            Slot& slot = slots_[current_];
+            if (slot.busy && !WaitForSlot(current_)) {
+                return false;
+            }
+            uint64_t to_copy = std::min(bytes, static_cast<uint64_t>(kUringBufferSize - slot.length));
+            memcpy(slot.buffer.get() + slot.length, pos, to_copy);
+            slot.length += to_copy;
+            pos += to_copy;
+            bytes -= to_copy;
+
+            if (slot.length == kUringBufferSize && !Submit(slot.length)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Flush() override {
+        if (!Drain()) {
+            return false;
+        }
+        if (fsync(fd_)) {
+            PLOG(ERROR) << "fsync failed: " << path_;
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t Size() override { return get_block_device_size(fd_); }
+
+    ssize_t Splice(int fd, size_t bytes) override {
+        // Spliced data goes through the buffered descriptor, so everything
+        // staged before it must be written first.
+        if (!Drain()) {
+            errno = EIO;
+            return -1;
+        }
+        loff_t offset = offset_;
+        auto start = InstallReport::Clock::now();
+        ssize_t rv = TEMP_FAILURE_RETRY(
+                splice(fd, nullptr, fd_, &offset, bytes, SPLICE_F_MOVE | SPLICE_F_MORE));
+        ReportCall();
+        if (rv > 0) {
+            ReportWrite(rv, InstallReport::Clock::now() - start);
+            offset_ += rv;
+        }
+        return rv;
+    }
+
+    bool Seek(uint64_t offset) override {
+        if (!Drain()) {
+            return false;
+        }
+        offset_ = offset;
+        return true;
+    }
+
+    bool Skip(uint64_t bytes) override {
+        if (!SubmitStaged()) {
+            return false;
+        }
+        offset_ += bytes;
+        return true;
+    }
+
+    bool WriteZeroes(uint64_t bytes) override {
+        if (!SubmitStaged()) {
+            return false;
+        }
+        if (offset_ % kZeroOutAlignment || bytes % kZeroOutAlignment) {
+            return WriteHelper::WriteZeroes(bytes);
+        }
+        auto start = InstallReport::Clock::now();
+        bool ok = ZeroOut(fd_, offset_, bytes, path_);
+        ReportCall();
+        if (!ok) {
+            return false;
+        }
+        ReportWrite(0, InstallReport::Clock::now() - start);
+        offset_ += bytes;
+        return true;
+    }
+
+  private:
+    struct Slot {
+        std::unique_ptr<char, decltype(&free)> buffer{nullptr, &free};
+        size_t length = 0;
+        bool busy = false;
+        // When the write was submitted, for its latency.
+        InstallReport::Clock::time_point submitted;
+    };
+
+    UringWriter(const std::string& path, unique_fd&& direct_fd, unique_fd&& fd)
+        : path_(path), direct_fd_(std::move(direct_fd)), fd_(std::move(fd)) {}
+
+    bool Init() {
+        int rv = io_uring_queue_init(kUringQueueDepth, &ring_, 0);
+        if (rv < 0) {
+            LOG(INFO) << "io_uring is not available: " << strerror(-rv);
+            return false;
+        }
+        ring_initialized_ = true;
+
+        slots_.resize(kUringQueueDepth);
+        std::vector<struct iovec> iovecs;
+        for (auto& slot : slots_) {
+            void* buffer;
+            if (posix_memalign(&buffer, kUringAlignment, kUringBufferSize)) {
+                LOG(ERROR) << "could not allocate io_uring buffers";
+                return false;
+            }
+            slot.buffer.reset(reinterpret_cast<char*>(buffer));
+            iovecs.push_back({.iov_base = buffer, .iov_len = kUringBufferSize});
+        }
+
+        // Registered buffers save the kernel from pinning pages on every
+        // write, but they count against RLIMIT_MEMLOCK, so they're optional.
+        fixed_buffers_ = !io_uring_register_buffers(&ring_, iovecs.data(), iovecs.size());
+        return true;
+    }
+
+    // Submit the first |length| bytes of the current slot, and move on to
+    // the next slot.
+    bool Submit(size_t length) {
+        Slot& slot = slots_[current_];
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+        if (!sqe) {
+            LOG(ERROR) << "io_uring submission queue is full";
+            return false;
+        }
+        if (fixed_buffers_) {
+            io_uring_prep_write_fixed(sqe, direct_fd_, slot.buffer.get(), length, offset_,
+                                      current_);
+        } else {
+            io_uring_prep_write(sqe, direct_fd_, slot.buffer.get(), length, offset_);
+        }
+        io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(current_));
+
+        slot.submitted = InstallReport::Clock::now();
+        int rv = io_uring_submit(&ring_);
+        ReportCall();
+        if (rv < 0) {
+            LOG(ERROR) << "io_uring_submit failed: " << strerror(-rv);
+            return false;
+        }
+
+        slot.busy = true;
+        slot.length = length;
+        offset_ += length;
+        in_flight_++;
+        current_ = (current_ + 1) % slots_.size();
+        return true;
+    }
+
+    // Wait for at least one completion, then reap every completion that is
+    // ready without waiting further.
+    bool Reap() {
+        struct io_uring_cqe* cqe;
+        int rv = io_uring_wait_cqe(&ring_, &cqe);
+        if (rv < 0) {
+            LOG(ERROR) << "io_uring_wait_cqe failed: " << strerror(-rv);
+            return false;
+        }
+
+        bool ok = true;
+        struct io_uring_cqe* cqes[kUringQueueDepth];
+        unsigned count = io_uring_peek_batch_cqe(&ring_, cqes, kUringQueueDepth);
+        for (unsigned i = 0; i < count; i++) {
+            size_t index = reinterpret_cast<size_t>(io_uring_cqe_get_data(cqes[i]));
+            Slot& slot = slots_[index];
+            if (cqes[i]->res < 0) {
+                LOG(ERROR) << "write failed: " << path_ << ": " << strerror(-cqes[i]->res);
+                ok = false;
+            } else if (static_cast<size_t>(cqes[i]->res) != slot.length) {
+                LOG(ERROR) << "short write to " << path_ << ": " << cqes[i]->res << " of "
+                           << slot.length << " bytes";
+                ok = false;
+            } else {
+                ReportWrite(slot.length, InstallReport::Clock::now() - slot.submitted);
+            }
+            slot.busy = false;
+            slot.length = 0;
+            in_flight_--;
+        }
+        io_uring_cq_advance(&ring_, count);
+        return ok;
+    }
+
+    // A slot covers contiguous data, so whatever is staged has to be sent
+    // off before the offset can jump.
+    bool SubmitStaged() {
+        Slot& slot = slots_[current_];
+        if (slot.busy || !slot.length) {
+            return true;
+        }
+        if (slot.length % kUringAlignment == 0) {
+            return Submit(slot.length);
+        }
+        return Drain();
+    }
+
+    bool WaitForSlot(size_t index) {
+        while (slots_[index].busy) {
+            if (!Reap()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Write out whatever is staged and wait for all outstanding writes.
+    bool Drain() {
+        if (!ring_initialized_) {
+            return true;
+        }
+
+        bool ok = true;
+        Slot& slot = slots_[current_];
+        if (!slot.busy && slot.length) {
+            size_t aligned = slot.length - (slot.length % kUringAlignment);
+            size_t tail = slot.length - aligned;
+            if (aligned) {
+                ok &= Submit(aligned);
+            }
+            if (tail) {
+                // Note that Submit() may have moved current_ along, so use
+                // the saved reference.
+                ok &= WriteBuffered(slot.buffer.get() + aligned, tail);
+                if (!aligned) {
+                    slot.length = 0;
+                }
+            }
+        }
+        while (in_flight_) {
+            ok &= Reap();
+        }
+        return ok;
+    }
+
+    bool WriteBuffered(const void* data, uint64_t bytes) {
+        if (!WriteFd(fd_, data, bytes, offset_)) {
+            PLOG(ERROR) << "write failed: " << path_;
+            return false;
+        }
+        offset_ += bytes;
+        return true;
+    }
+
+    std::string path_;
+    unique_fd direct_fd_;
+    unique_fd fd_;
+    struct io_uring ring_;
+    bool ring_initialized_ = false;
+    bool fixed_buffers_ = false;
+    std::vector<Slot> slots_;
+    size_t current_ = 0;
+    unsigned in_flight_ = 0;
+    // Device offset at which the current slot's data begins.
+    uint64_t offset_ = 0;
+};
+
+// Write data through a SplitFiemap.
+class SplitFiemapWriter final : public GsiService::WriteHelper {
+  public:
+    explicit SplitFiemapWriter(SplitFiemap* writer) : writer_(writer) {}
+
+    // SplitFiemap makes its own write() calls, so each Write() is counted
+    // as one call.
+    bool Write(const void* data, uint64_t bytes) override {
+        auto start = InstallReport::Clock::now();
+        bool ok = writer_->Write(data, bytes);
+        ReportCall();
+        if (ok) {
+            ReportWrite(bytes, InstallReport::Clock::now() - start);
+        }
+        return ok;
+    }
+    bool Flush() override {
+        return writer_->Flush();
+    }
+    uint64_t Size() override { return writer_->size(); }
+
+  private:
+    SplitFiemap* writer_;
+};
+
+std::unique_ptr<GsiService::WriteHelper> GsiService::OpenMeasuredPartition(
+        const std::string& name) {
+    auto writer = OpenPartition(name);
+    if (writer) {
+        writer->set_report(&install_report_);
+    }
+    return writer;
+}
+
+std::unique_ptr<GsiService::WriteHelper> GsiService::OpenPartition(const std::string& name) {
+    if (can_use_devicemapper_) {
+        std::string path;
+        if (!CreateLogicalPartition(kUserdataDevice, *metadata_.get(), name, true, kDmTimeout,
+                                    &path)) {
+            LOG(ERROR) << "Error creating device-mapper node for " << name;
+            return {};
+        }
+
+        // Prefer io_uring, falling back to plain writes if the kernel does
+        // not support it.
+        auto image_path = GetImagePath(install_dir_, name);
+        if (auto writer = UringWriter::Open(image_path, path)) {
+            return writer;
+        }
+
+        static const int kOpenFlags = O_RDWR | O_NOFOLLOW | O_CLOEXEC;
+        unique_fd fd(open(path.c_str(), kOpenFlags));
+        if (fd < 0) {
+            PLOG(ERROR) << "could not open " << path;
+        }
+        return std::make_unique<FdWriter>(image_path, std::move(fd));
+    }
+
+    auto iter = partitions_.find(name);
+    if (iter == partitions_.end()) {
+        LOG(ERROR) << "could not find partition " << name;
+        return {};
+    }
+    return std::make_unique<SplitFiemapWriter>(iter->second.writer.get());
+}
+
+// A fixed set of buffers handed back and forth between a producer thread and
+// a consumer thread. Filled buffers are consumed in the order they were
+// produced; consumed buffers are recycled, so memory use is bounded by the
+// number of buffers in the ring.
+class BufferRing final {
+  public:
+    struct Buffer {
+        std::unique_ptr<char[]> data;
+        size_t capacity = 0;
+        size_t length = 0;
+    };
+
+    BufferRing(size_t count, size_t buffer_size) : buffers_(count) {
+        for (auto& buffer : buffers_) {
+            buffer.data = std::make_unique<char[]>(buffer_size);
+            buffer.capacity = buffer_size;
+            free_.push_back(&buffer);
+        }
+    }
+
+    // Producer side. Returns null if the consumer aborted.
+    Buffer* AcquireFree() {
+        std::unique_lock<std::mutex> lock(lock_);
+        cv_.wait(lock, [this] { return aborted_ || !free_.empty(); });
+        if (aborted_) return nullptr;
+        Buffer* buffer = free_.front();
+        free_.pop_front();
+        buffer->length = 0;
+        return buffer;
+    }
+    void PushReady(Buffer* buffer) {
+        std::lock_guard<std::mutex> guard(lock_);
+        ready_.push_back(buffer);
+        cv_.notify_all();
+    }
+    // Signal that no more buffers will be produced.
+    void Finish() {
+        std::lock_guard<std::mutex> guard(lock_);
+        finished_ = true;
+        cv_.notify_all();
+    }
+
+    // Consumer side. Returns null once the producer has finished and every
+    // produced buffer has been consumed, or if the ring was aborted.
+    Buffer* PopReady() {
+        std::unique_lock<std::mutex> lock(lock_);
+        cv_.wait(lock, [this] { return aborted_ || finished_ || !ready_.empty(); });
+        if (aborted_ || ready_.empty()) return nullptr;
+        Buffer* buffer = ready_.front();
+        ready_.pop_front();
+        return buffer;
+    }
+    void Release(Buffer* buffer) {
+        std::lock_guard<std::mutex> guard(lock_);
+        free_.push_back(buffer);
+        cv_.notify_all();
+    }
+
+    // Either side may abort; the other side will stop at its next call.
+    void Abort() {
+        std::lock_guard<std::mutex> guard(lock_);
+        aborted_ = true;
+        cv_.notify_all();
+    }
+    bool aborted() {
+        std::lock_guard<std::mutex> guard(lock_);
+        return aborted_;
+    }
+
+  private:
+    std::vector<Buffer> buffers_;
+    std::deque<Buffer*> free_;
+    std::deque<Buffer*> ready_;
+    std::mutex lock_;
+    std::condition_variable cv_;
+    bool finished_ = false;
+    bool aborted_ = false;
+};
+
+// Read exactly |bytes| from the stream |fd| into |data|. Returns false on a
+// read error, premature EOF, or once |aborted| returns true.
+static bool ReadStreamFully(int fd, char* data, size_t bytes, const std::function<bool()>& aborted,
+                            InstallReport* report) {
+    while (bytes) {
+        // Don't block forever in read() if the writer gave up or the
+        // install was cancelled.
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int rv = TEMP_FAILURE_RETRY(poll(&pfd, 1, kStreamPollIntervalMs));
+        if (rv < 0) {
+            PLOG(ERROR) << "poll gsi stream";
+            return false;
+        }
+        if (aborted()) {
+            return false;
+        }
+        if (rv == 0) {
+            continue;
+        }
+
+        ssize_t n = TEMP_FAILURE_RETRY(read(fd, data, bytes));
+        report->AddRead();
+        if (n < 0) {
+            PLOG(ERROR) << "read gsi chunk";
+            return false;
+        }
+        if (n == 0) {
+            LOG(ERROR) << "no bytes left in stream";
+            return false;
+        }
+        data += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+// Read |bytes| from |fd| into buffers from |ring|. Each buffer is filled
+// completely (except possibly the last) so that writes stay large. Returns
+// false on a read error, premature EOF, or if the ring was aborted.
+static bool ReadStreamIntoRing(int fd, uint64_t bytes, BufferRing* ring,
+                               const std::atomic<bool>& should_abort, InstallReport* report) {
+    auto aborted = [&]() -> bool { return should_abort || ring->aborted(); };
+    uint64_t remaining = bytes;
+    while (remaining) {
+        BufferRing::Buffer* buffer = ring->AcquireFree();
+        if (!buffer) {
+            return false;
+        }
+        size_t to_fill = std::min(static_cast<uint64_t>(buffer->capacity), remaining);
+        if (!ReadStreamFully(fd, buffer->data.get(), to_fill, aborted, report)) {
+            ring->Abort();
+            return false;
+        }
+        buffer->length = to_fill;
+        remaining -= buffer->length;
+        ring->PushReady(buffer);
+    }
+    ring->Finish();
+    return true;
+}
+
+// Decompress buffers from |input| into buffers from |output|. Output
+// buffers are only handed on once full (except the last), so that writes
+// stay large. Aborting either ring stops both.
+static bool DecompressRing(Decompressor* decompressor, BufferRing* input, BufferRing* output) {
+    auto fail = [&]() -> bool {
+        input->Abort();
+        output->Abort();
+        return false;
+    };
+
+    BufferRing::Buffer* out = nullptr;
+    while (BufferRing::Buffer* in = input->PopReady()) {
+        const char* pos = in->data.get();
+        size_t remaining = in->length;
+        while (true) {
+            if (!out && !(out = output->AcquireFree())) {
+                input->Release(in);
+                return fail();
+            }
+            size_t old_remaining = remaining;
+            size_t old_length = out->length;
+            if (!decompressor->Decompress(&pos, &remaining, out->data.get(), out->capacity,
+                                          &out->length)) {
+                input->Release(in);
+                return fail();
+            }
+
+            // A full buffer may mean there is more output pending, even if
+            // all of the input was consumed.
+            bool full = (out->length == out->capacity);
+            if (full) {
+                output->PushReady(out);
+                out = nullptr;
+            }
+            if (!remaining && !full) {
+                break;
+            }
+            if (!full && remaining == old_remaining && out->length == old_length) {
+                LOG(ERROR) << "decompressor made no progress";
+                input->Release(in);
+                return fail();
+            }
+        }
+        input->Release(in);
+        if (output->aborted()) {
+            return fail();
+        }
+    }
+    if (input->aborted()) {
+        return fail();
+    }
+
+    if (out && out->length) {
+        output->PushReady(out);
+    } else if (out) {
+        output->Release(out);
+    }
+    output->Finish();
+    return true;
+}
+
+uint64_t GsiService::GetStreamBufferSize() const {
+    uint64_t size = io_buffer_size_;
+    if (!size) {
+        // Larger images get larger buffers, up to a few MiB; beyond that the
+        // syscall overhead is negligible and we'd only be wasting memory.
+        size = std::clamp(gsi_size_ / 1024, kMinDefaultIoBufferSize, kMaxDefaultIoBufferSize);
+    }
+
+    // Round up to a whole number of filesystem blocks.
+    uint64_t block_size = std::max(system_block_size_, static_cast<uint64_t>(1));
+    return ((size + block_size - 1) / block_size) * block_size;
+}
+
+bool GsiService::CommitGsiChunk(int stream_fd, int64_t bytes) {
+    StartAsyncOperation("write gsi", gsi_size_);
+
+    if (bytes < 0) {
+        LOG(ERROR) << "chunk size " << bytes << " is negative";
+        return false;
+    }
+    if (!installing_) {
+        LOG(ERROR) << "no gsi installation in progress";
+        return false;
+    }
+
+    // Look at the start of the stream before deciding how to move the rest
+    // of it, since sparse images have to pass through the decoder. With
+    // compression, this happens after decompression instead.
+    if (!image_format_known_ && !decompressor_ && bytes) {
+        char header[kSparseHeaderSize];
+        size_t to_read = std::min(static_cast<uint64_t>(bytes), sizeof(header));
+        auto aborted = [this]() -> bool { return should_abort_; };
+        if (!ReadStreamFully(stream_fd, header, to_read, aborted, &install_report_)) {
+            return false;
+        }
+        if (!CommitGsiChunk(header, to_read)) {
+            return false;
+        }
+        bytes -= to_read;
+    }
+
+    // Splicing only makes sense when writing raw data straight to a block
+    // device.
+    bool ok = false;
+    bool unsupported = true;
+    if (can_use_devicemapper_ && !sparse_decoder_ && !decompressor_ &&
+        expected_digest_.empty()) {
+        ok = SpliceGsiChunk(stream_fd, bytes, &unsupported);
+    }
+    if (!ok && unsupported) {
+        ok = PipelineGsiChunk(stream_fd, bytes);
+    }
+    if (!ok) {
+        return false;
+    }
+
+    UpdateProgress(STATUS_COMPLETE, gsi_size_);
+    return true;
+}
+
+// Move |bytes| from |stream_fd| to the system image with splice(), so the data
+// is never copied through our address space. If splice() cannot be used with
+// this stream, |unsupported| is set and nothing is consumed from it.
+bool GsiService::SpliceGsiChunk(int stream_fd, uint64_t bytes, bool* unsupported) {
+    *unsupported = false;
+
+    struct stat s;
+    if (fstat(stream_fd, &s)) {
+        PLOG(ERROR) << "fstat gsi stream";
+        return false;
+    }
+
+    // splice() needs a pipe on one end. Pipes can go straight to the device;
+    // sockets have to bounce through a pipe of our own. Other kinds of
+    // streams use the read/write path.
+    unique_fd pipe_read, pipe_write;
+    if (S_ISSOCK(s.st_mode)) {
+        if (!android::base::Pipe(&pipe_read, &pipe_write)) {
+            PLOG(ERROR) << "pipe";
+            return false;
+        }
+        fcntl(pipe_write, F_SETPIPE_SZ, kSplicePipeSize);
+    } else if (S_ISFIFO(s.st_mode)) {
+        fcntl(stream_fd, F_SETPIPE_SZ, kSplicePipeSize);
+    } else {
+        *unsupported = true;
+        return false;
+    }
+
+    if (bytes > gsi_size_ - gsi_bytes_written_) {
+        LOG(ERROR) << "chunk size " << bytes << " exceeds remaining image size (" << gsi_size_
+                   << " expected, " << gsi_bytes_written_ << " written)";
+        return false;
+    }
+
+    int progress = -1;
+    uint64_t remaining = bytes;
+    while (remaining) {
+        struct pollfd pfd = {.fd = stream_fd, .events = POLLIN};
+        int rv = TEMP_FAILURE_RETRY(poll(&pfd, 1, kStreamPollIntervalMs));
+        if (rv < 0) {
+            PLOG(ERROR) << "poll gsi stream";
+            return false;
+        }
+        if (should_abort_) {
+            return false;
+        }
+        if (rv == 0) {
+            continue;
+        }
+
+        size_t to_splice = std::min(remaining, static_cast<uint64_t>(kSplicePipeSize));
+        ssize_t n;
+        if (pipe_read >= 0) {
+            n = TEMP_FAILURE_RETRY(splice(stream_fd, nullptr, pipe_write, nullptr, to_splice,
+                                          SPLICE_F_MOVE | SPLICE_F_MORE));
+        } else {
+            n = system_writer_->Splice(stream_fd, to_splice);
+        }
+        install_report_.AddRead();
+        if (n < 0 && remaining == bytes && (errno == EINVAL || errno == EOPNOTSUPP)) {
+            // Nothing was consumed, so the caller can fall back.
+            LOG(INFO) << "splice is not supported for this stream, falling back to read/write";
+            *unsupported = true;
+            return false;
+        }
+        if (n < 0) {
+            PLOG(ERROR) << "splice gsi chunk";
+            return false;
+        }
+        if (n == 0) {
+            LOG(ERROR) << "no bytes left in stream";
+            return false;
+        }
+        if (remaining == bytes) {
+            SetProgressIoPath(IO_PATH_SPLICE);
+            // We never see spliced data, so we can't hash it either.
+            image_hasher_ = nullptr;
+        }
+
+        // Empty our intermediate pipe, if any, into the device.
+        for (size_t left = (pipe_read >= 0) ? n : 0; left;) {
+            ssize_t m = system_writer_->Splice(pipe_read, left);
+            if (m <= 0) {
+                PLOG(ERROR) << "splice gsi chunk to " << system_gsi_path_;
+                return false;
+            }
+            left -= m;
+        }
+
+        remaining -= n;
+        gsi_bytes_written_ += n;
+        // We never see spliced data, so it is checksummed by reading it back
+        // when the next checkpoint is written.
+        MaybeWriteCheckpoint();
+
+        int new_progress = (gsi_bytes_written_ * 1000) / gsi_size_;
+        if (new_progress != progress) {
+            progress = new_progress;
+            UpdateProgress(STATUS_WORKING, gsi_bytes_written_);
+        }
+    }
+    return true;
+}
+
+// Copy |bytes| from |stream_fd| to the system image. Reads happen on a
+// separate thread, so that the stream keeps draining while the previous
+// buffer is being written to disk. Compressed streams get a third thread,
+// between the two, for decompression.
+bool GsiService::PipelineGsiChunk(int stream_fd, uint64_t bytes) {
+    SetProgressIoPath(IO_PATH_READ_WRITE);
+
+    BufferRing ring(kStreamBufferCount, GetStreamBufferSize());
+    bool read_ok = false;
+    std::thread reader([&]() -> void {
+        read_ok = ReadStreamIntoRing(stream_fd, bytes, &ring, should_abort_, &install_report_);
+    });
+
+    std::unique_ptr<BufferRing> decompressed_ring;
+    std::thread decompressor;
+    bool decompress_ok = true;
+    if (decompressor_) {
+        decompressed_ring = std::make_unique<BufferRing>(kStreamBufferCount, GetStreamBufferSize());
+        decompressor = std::thread([&]() -> void {
+            decompress_ok = DecompressRing(decompressor_.get(), &ring, decompressed_ring.get());
+        });
+    }
+    BufferRing* write_ring = decompressed_ring ? decompressed_ring.get() : &ring;
+
+    bool write_ok = true;
+    int progress = -1;
+    while (BufferRing::Buffer* buffer = write_ring->PopReady()) {
+        // :TODO: check file pin status!
+        write_ok = CommitGsiChunk(buffer->data.get(), buffer->length);
+        write_ring->Release(buffer);
+        if (!write_ok) {
+            write_ring->Abort();
+            break;
+        }
+
+        // Only update the progress when the % (or permille, in this case)
+        // significantly changes.
+        int new_progress = (gsi_bytes_written_ * 1000) / gsi_size_;
+        if (new_progress != progress) {
+            progress = new_progress;
+            UpdateProgress(STATUS_WORKING, gsi_bytes_written_);
+        }
+    }
+    if (decompressor.joinable()) {
+        decompressor.join();
+    }
+    reader.join();
+
+    return write_ok && decompress_ok && read_ok;
+}
+
+bool GsiService::CommitGsiChunk(const void* data, size_t bytes) {
+    if (!installing_) {
+        LOG(ERROR) << "no gsi installation in progress";
+        return false;
+    }
+
+    // The first bytes of the stream tell us whether it is a raw image or an
+    // Android sparse image. Sparse images are expanded as they arrive.
+    if (!image_format_known_ && bytes) {
+        image_format_known_ = true;
+        uint64_t image_size;
+        if (SparseDecoder::IsSparse(data, bytes, &image_size)) {
+            // The images were allocated before the header could be seen, so
+            // for a compressed stream the size given must already be the
+            // expanded size.
+            if (image_size != gsi_size_) {
+                LOG(ERROR) << "sparse image expands to " << image_size << " bytes, expected "
+                           << gsi_size_
+                           << (decompressor_ ? " (the size of a compressed sparse image must be "
+                                               "its expanded size)"
+                                             : "");
+                return false;
+            }
+            LOG(INFO) << "decoding sparse image";
+            sparse_decoder_ = std::make_unique<SparseDecoder>(
+                    [this](const void* data, uint64_t bytes) { return WriteGsiData(data, bytes); },
+                    [this](uint32_t value, uint64_t bytes) { return FillGsiData(value, bytes); },
+                    [this](uint64_t bytes) { return SkipGsiData(bytes); });
+        }
+    }
+    if (sparse_decoder_) {
+        return sparse_decoder_->Decode(data, bytes);
+    }
+    return WriteGsiData(data, bytes);
+}
+
+bool GsiService::WriteGsiData(const void* data, uint64_t bytes) {
+    if (bytes > gsi_size_ - gsi_bytes_written_) {
+        // We cannot write past the end of the image file.
+        LOG(ERROR) << "chunk size " << bytes << " exceeds remaining image size (" << gsi_size_
+                   << " expected, " << gsi_bytes_written_ << " written)";
+        return false;
+    }
+
+    // Through device-mapper, runs of zeroes can be zeroed on the device
+    // instead of being copied to it.
+    bool ok;
+    if (can_use_devicemapper_) {
+        ok = WriteElidingZeroes(reinterpret_cast<const char*>(data), bytes);
+    } else {
+        ok = system_writer_->Write(data, bytes);
+    }
+    if (!ok) {
+        PLOG(ERROR) << "write failed";
+        return false;
+    }
+    // Once the checksum has fallen behind, it can only catch up in order.
+    if (gsi_checksum_bytes_ == gsi_bytes_written_) {
+        gsi_checksum_ = crc32(gsi_checksum_, reinterpret_cast<const Bytef*>(data), bytes);
+        gsi_checksum_bytes_ += bytes;
+    }
+    if (image_hasher_) {
+        image_hasher_->Update(data, bytes);
+    }
+    gsi_bytes_written_ += bytes;
+    MaybeWriteCheckpoint();
+    return true;
+}
+
+// Returns true if |bytes| at |data| are all zero. This is a plain loop over
+// 64-bit words, which the compiler vectorizes.
+static bool IsZero(const char* data, size_t bytes) {
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        bits |= word;
+    }
+    for (; i < bytes; i++) {
+        bits |= data[i];
+    }
+    return !bits;
+}
+
+// Write |bytes| of image data at gsi_bytes_written_, replacing long runs of
+// zero blocks with WriteZeroes(). Blocks are aligned to the image, not to
+// |data|.
+bool GsiService::WriteElidingZeroes(const char* data, uint64_t bytes) {
+    uint64_t pending = 0;
+    uint64_t misalignment = gsi_bytes_written_ % kZeroBlockSize;
+    uint64_t block = misalignment ? kZeroBlockSize - misalignment : 0;
+    while (block + kZeroBlockSize <= bytes) {
+        if (!IsZero(data + block, kZeroBlockSize)) {
+            block += kZeroBlockSize;
+            continue;
+        }
+        uint64_t run_end = block + kZeroBlockSize;
+        while (run_end + kZeroBlockSize <= bytes && IsZero(data + run_end, kZeroBlockSize)) {
+            run_end += kZeroBlockSize;
+        }
+        if (run_end - block >= kMinZeroRun) {
+            if (block > pending && !system_writer_->Write(data + pending, block - pending)) {
+                return false;
+            }
+            if (!system_writer_->WriteZeroes(run_end - block)) {
+                return false;
+            }
+            AddZeroedBytes(run_end - block);
+            pending = run_end;
+        }
+        block = run_end;
+    }
+    if (bytes > pending && !system_writer_->Write(data + pending, bytes - pending)) {
+        return false;
+    }
+    return true;
+}
+
+bool GsiService::ZeroGsiData(uint64_t bytes) {
+    if (bytes > gsi_size_ - gsi_bytes_written_) {
+        LOG(ERROR) << "chunk size " << bytes << " exceeds remaining image size (" << gsi_size_
+                   << " expected, " << gsi_bytes_written_ << " written)";
+        return false;
+    }
+    if (!system_writer_->WriteZeroes(bytes)) {
+        PLOG(ERROR) << "write failed";
+        return false;
+    }
+    AddZeroedBytes(bytes);
+    if (image_hasher_) {
+        image_hasher_->UpdateZeroes(bytes);
+    }
+    // The zeroed range is checksummed by reading it back when the next
+    // checkpoint is written.
+    gsi_bytes_written_ += bytes;
+    return true;
+}
+
+void GsiService::AddZeroedBytes(uint64_t bytes) {
+    gsi_bytes_zeroed_ += bytes;
+    install_report_.AddZeroed(bytes);
+    progress_bytes_zeroed_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+bool GsiService::FillGsiData(uint32_t value, uint64_t bytes) {
+    // Zero fills don't need a buffer at all.
+    if (!value && can_use_devicemapper_) {
+        return ZeroGsiData(bytes);
+    }
+
+    // Expand the pattern into a buffer once, and write it repeatedly.
+    uint64_t buffer_size = std::min(bytes, GetStreamBufferSize());
+    std::vector<uint32_t> buffer((buffer_size + sizeof(value) - 1) / sizeof(value), value);
+    while (bytes) {
+        uint64_t to_write = std::min(bytes, buffer_size);
+        if (!WriteGsiData(buffer.data(), to_write)) {
+            return false;
+        }
+        bytes -= to_write;
+    }
+    return true;
+}
+
+bool GsiService::SkipGsiData(uint64_t bytes) {
+    // Digests treat skipped ranges as zeroes, like simg2img does. To check
+    // the digest, the disk has to agree.
+    if (!expected_digest_.empty()) {
+        return ZeroGsiData(bytes);
+    }
+
+    if (bytes > gsi_size_ - gsi_bytes_written_) {
+        LOG(ERROR) << "skip of " << bytes << " bytes exceeds remaining image size";
+        return false;
+    }
+    if (!system_writer_->Skip(bytes)) {
+        PLOG(ERROR) << "skip failed";
+        return false;
+    }
+    if (image_hasher_) {
+        image_hasher_->UpdateZeroes(bytes);
+    }
+    // What's on disk in the skipped range is unknown.
+    stripe_digest_valid_ = false;
+    gsi_bytes_written_ += bytes;
+    install_report_.AddSkipped(bytes);
+    return true;
+}
+
+bool GsiService::MapAshmem(int fd, int64_t size) {
+    UnmapAshmem();
+
+    if (!installing_) {
+        LOG(ERROR) << "no gsi installation in progress";
+        return false;
+    }
+    if (size <= 0) {
+        LOG(ERROR) << "invalid ashmem size: " << size;
+        return false;
+    }
+
+    // The region must not be able to shrink underneath the mapping, or reading
+    // from it would fault. It can still be written to, which the copy in
+    // CommitGsiChunkFromAshmem() takes care of.
+    if (ashmem_valid(fd)) {
+        int region_size = ashmem_get_size_region(fd);
+        if (region_size < 0 || static_cast<uint64_t>(region_size) < static_cast<uint64_t>(size)) {
+            LOG(ERROR) << "ashmem region is smaller than " << size << " bytes";
+            return false;
+        }
+    } else {
+        int seals = fcntl(fd, F_GET_SEALS);
+        if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+            LOG(ERROR) << "shared memory must be ashmem or a memfd sealed against shrinking";
+            return false;
+        }
+        struct stat s;
+        if (fstat(fd, &s)) {
+            PLOG(ERROR) << "fstat shared memory";
+            return false;
+        }
+        if (s.st_size < size) {
+            LOG(ERROR) << "memfd is smaller than " << size << " bytes";
+            return false;
+        }
+    }
+
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        PLOG(ERROR) << "mmap shared memory";
+        return false;
+    }
+    ashmem_data_ = data;
+    ashmem_size_ = size;
+    ashmem_offset_ = 0;
+    ashmem_copy_size_ = std::min(static_cast<uint64_t>(size), GetStreamBufferSize());
+    ashmem_copy_ = std::make_unique<char[]>(ashmem_copy_size_);
+    return true;
+}
+
+void GsiService::UnmapAshmem() {
+    if (ashmem_data_) {
+        munmap(ashmem_data_, ashmem_size_);
+    }
+    ashmem_data_ = nullptr;
+    ashmem_size_ = 0;
+    ashmem_offset_ = 0;
+    ashmem_copy_ = nullptr;
+    ashmem_copy_size_ = 0;
+}
+
+bool GsiService::CommitGsiChunkFromAshmem(int64_t bytes) {
+    if (!ashmem_data_) {
+        LOG(ERROR) << "setGsiAshmem must be called first";
+        return false;
+    }
+    if (bytes < 0 || static_cast<uint64_t>(bytes) > ashmem_size_) {
+        LOG(ERROR) << "chunk size " << bytes << " does not fit in shared memory of "
+                   << ashmem_size_ << " bytes";
+        return false;
+    }
+
+    // Consume up to the end of the region, then wrap around to the start.
+    // Each piece is copied out of the region once, so that the writer, the
+    // checksum and the digest all see the same bytes even if the client
+    // writes to the region meanwhile.
+    const char* data = reinterpret_cast<const char*>(ashmem_data_);
+    size_t remaining = bytes;
+    while (remaining) {
+        size_t to_write = std::min({remaining, ashmem_size_ - ashmem_offset_, ashmem_copy_size_});
+        memcpy(ashmem_copy_.get(), data + ashmem_offset_, to_write);
+        if (!CommitGsiChunk(ashmem_copy_.get(), to_write)) {
+            return false;
+        }
+        ashmem_offset_ = (ashmem_offset_ + to_write) % ashmem_size_;
+        remaining -= to_write;
+    }
+    return true;
+}
+
+void GsiService::MaybeWriteCheckpoint() {
+    // An offset into a sparse or compressed image can't be mapped back to an
+    // offset in the stream, so those installs can only resume from the start.
+    if (sparse_decoder_ || decompressor_) {
+        return;
+    }
+    if (gsi_bytes_written_ - last_checkpoint_ < kCheckpointInterval) {
+        return;
+    }
+    // Failing to save a checkpoint only means an interrupted install would
+    // resume from an earlier one, so it's not fatal.
+    WriteCheckpoint();
+}
+
+bool GsiService::WriteCheckpoint() {
+    // The checkpoint must never claim more than what is durable on disk.
+    if (!system_writer_->Flush()) {
+        return false;
+    }
+
+    // Bring the checksum up to date with data that didn't pass through
+    // memory, now that it is on disk. Without device-mapper, nothing
+    // bypasses memory.
+    if (can_use_devicemapper_ && gsi_checksum_bytes_ < gsi_bytes_written_) {
+        if (ChecksumSystemImage(gsi_checksum_bytes_, gsi_bytes_written_ - gsi_checksum_bytes_,
+                                false, &gsi_checksum_)) {
+            gsi_checksum_bytes_ = gsi_bytes_written_;
+        } else {
+            // Don't try again; the checkpoint is saved without a checksum.
+            gsi_checksum_bytes_ = UINT64_MAX;
+        }
+    }
+
+    InstallCheckpoint checkpoint = {
+            .install_dir = install_dir_,
+            .gsi_size = gsi_size_,
+            .userdata_size = userdata_size_,
+            .bytes_written = gsi_bytes_written_,
+            .has_checksum = gsi_checksum_bytes_ == gsi_bytes_written_,
+            .checksum = gsi_checksum_,
+            .wipe_userdata_on_failure = wipe_userdata_on_failure_,
+    };
+    if (!WriteInstallCheckpoint(checkpoint)) {
+        return false;
+    }
+    last_checkpoint_ = gsi_bytes_written_;
+    return true;
+}
+
+// Extend |checksum| with the CRC32 of |bytes| of the mapped system image at
+// |offset|. When |resuming|, this is reported as its own step, and the data
+// is also passed to the image hasher.
+bool GsiService::ChecksumSystemImage(uint64_t offset, uint64_t bytes, bool resuming,
+                                     uint32_t* checksum) {
+    std::string path;
+    if (!DeviceMapper::Instance().GetDmDevicePathByName("system_gsi", &path)) {
+        LOG(ERROR) << "could not find device-mapper node for system_gsi";
+        return false;
+    }
+    unique_fd fd(open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << path;
+        return false;
+    }
+
+    if (resuming) {
+        StartAsyncOperation("verify checkpoint", bytes);
+    }
+
+    uint64_t buffer_size = GetStreamBufferSize();
+    auto buffer = std::make_unique<char[]>(buffer_size);
+    uint32_t crc = *checksum;
+    for (uint64_t done = 0; done < bytes;) {
+        if (should_abort_) {
+            LOG(ERROR) << "checksum of " << path << " was cancelled";
+            return false;
+        }
+        size_t to_read = std::min(buffer_size, bytes - done);
+        if (!android::base::ReadFullyAtOffset(fd, buffer.get(), to_read, offset + done)) {
+            PLOG(ERROR) << "read " << path;
+            return false;
+        }
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(buffer.get()), to_read);
+        done += to_read;
+        if (resuming) {
+            if (image_hasher_) {
+                image_hasher_->Update(buffer.get(), to_read);
+            }
+            UpdateProgress(STATUS_WORKING, done);
+        }
+    }
+    *checksum = crc;
+    return true;
+}
+
+// Collect the digests computed while the image was written, and compare
+// against the expected digest, if any. The stripe digest is saved so that
+// the image can be verified later.
+bool GsiService::CheckImageDigest() {
+    if (image_hasher_) {
+        std::string manifest;
+        image_hasher_->Finish(&image_digest_, &image_stripe_digest_, &manifest);
+        image_hasher_ = nullptr;
+
+        // Neither is fatal to lose: a later verification needs an explicit
+        // digest, and the manifest is rebuilt when it is asked for.
+        if (stripe_digest_valid_) {
+            if (!android::base::WriteStringToFile(image_stripe_digest_, kGsiImageDigestFile)) {
+                PLOG(ERROR) << "write failed: " << kGsiImageDigestFile;
+            }
+            WriteFileAtomically(GetManifestPath(install_dir_, "system_gsi"), manifest);
+        }
+    }
+
+    if (expected_digest_.empty()) {
+        return true;
+    }
+    if (image_digest_.empty()) {
+        LOG(ERROR) << "image digest was not computed";
+        return false;
+    }
+    if (image_digest_ != expected_digest_) {
+        LOG(ERROR) << "image digest mismatch: expected " << expected_digest_ << ", got "
+                   << image_digest_;
+        return false;
+    }
+    LOG(INFO) << "image digest verified: " << image_digest_;
+    return true;
+}
+
+int GsiService::SetGsiBootable(bool one_shot) {
+    if (gsi_bytes_written_ != gsi_size_) {
+        // We cannot boot if the image is incomplete.
+        LOG(ERROR) << "image incomplete; expected " << gsi_size_ << " bytes, waiting for "
+                   << (gsi_size_ - gsi_bytes_written_) << " bytes";
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (sparse_decoder_ && !sparse_decoder_->finished()) {
+        LOG(ERROR) << "sparse image incomplete";
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (decompressor_ && !decompressor_->finished()) {
+        LOG(ERROR) << "compressed stream incomplete";
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (gsi_bytes_zeroed_) {
+        LOG(INFO) << gsi_bytes_zeroed_ << " of " << gsi_size_
+                  << " bytes were zeroed on disk instead of written";
+    }
+
+    if (!system_writer_->Flush()) {
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    if (!CheckImageDigest()) {
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    // If files moved (are no longer pinned), the metadata file will be invalid.
+    for (const auto& [name, image] : partitions_) {
+        if (!image.writer->HasPinnedExtents()) {
+            LOG(ERROR) << name << " no longer has pinned extents";
+            return INSTALL_ERROR_GENERIC;
+        }
+    }
+
+    // Remember the installation directory.
+    if (!android::base::WriteStringToFile(install_dir_, kGsiInstallDirFile)) {
+        PLOG(ERROR) << "write failed: " << kGsiInstallDirFile;
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    // Note: create the install status file last, since this is the actual boot
+    // indicator.
+    if (!CreateMetadataFile() || !SetBootMode(one_shot) || !CreateInstallStatusFile()) {
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    // The install is complete, so there is nothing left to resume.
+    android::base::RemoveFileIfExists(kGsiInstallCheckpointFile);
+    return INSTALL_OK;
+}
+
+int GsiService::ReenableGsi(bool one_shot) {
+    if (!android::gsi::IsGsiInstalled()) {
+        LOG(ERROR) << "no gsi installed - cannot re-enable";
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    std::string boot_key;
+    if (!GetInstallStatus(&boot_key)) {
+        PLOG(ERROR) << "read " << kGsiInstallStatusFile;
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (boot_key != kInstallStatusDisabled) {
+        LOG(ERROR) << "GSI is not currently disabled";
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    if (IsGsiRunning()) {
+        if (!SetBootMode(one_shot) || !CreateInstallStatusFile()) {
+            return INSTALL_ERROR_GENERIC;
+        }
+        return INSTALL_OK;
+    }
+    // Note: this metadata is only used to recover the original partition sizes.
+    // We do not trust the extent information, which will get rebuilt later.
+    auto old_metadata = ReadFromImageFile(kGsiLpMetadataFile);
+    if (!old_metadata) {
+        LOG(ERROR) << "GSI install is incomplete";
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    // Set up enough installer state so that we can use various helper
+    // methods.
+    //
+    // TODO(dvander) Extract all of the installer state into a separate
+    // class so this is more manageable.
+    install_dir_ = GetInstalledImageDir();
+    system_gsi_path_ = GetImagePath(install_dir_, "system_gsi");
+    if (int error = DetermineReadWriteMethod()) {
+        return error;
+    }
+
+    // Recover parition information.
+    Image userdata_image;
+    if (int error = GetExistingImage(*old_metadata.get(), "userdata_gsi", &userdata_image)) {
+        return error;
+    }
+    partitions_.emplace(std::make_pair("userdata_gsi", std::move(userdata_image)));
+
+    Image system_image;
+    if (int error = GetExistingImage(*old_metadata.get(), "system_gsi", &system_image)) {
+        return error;
+    }
+    partitions_.emplace(std::make_pair("system_gsi", std::move(system_image)));
+
+    metadata_ = CreateMetadata();
+    if (!metadata_) {
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (!CreateMetadataFile() || !SetBootMode(one_shot) || !CreateInstallStatusFile()) {
+        return INSTALL_ERROR_GENERIC;
+    }
+    return INSTALL_OK;
+}
+
+int GsiService::WipeUserdata() {
+    // Note: this metadata is only used to recover the original partition sizes.
+    // We do not trust the extent information, which will get rebuilt later.
+    auto old_metadata = ReadFromImageFile(kGsiLpMetadataFile);
+    if (!old_metadata) {
+        LOG(ERROR) << "GSI install is incomplete";
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    install_dir_ = GetInstalledImageDir();
+    system_gsi_path_ = GetImagePath(install_dir_, "system_gsi");
+    if (int error = DetermineReadWriteMethod()) {
+        return error;
+    }
+
+    // Recover parition information.
+    Image userdata_image;
+    if (int error = GetExistingImage(*old_metadata.get(), "userdata_gsi", &userdata_image)) {
+        return error;
+    }
+    partitions_.emplace(std::make_pair("userdata_gsi", std::move(userdata_image)));
+
+    metadata_ = CreateMetadata();
+    if (!metadata_) {
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    auto writer = OpenPartition("userdata_gsi");
+    if (!writer) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+
+    // Wipe the first 1MiB of the device, ensuring both the first block and
+    // the superblock are destroyed.
+    static constexpr uint64_t kEraseSize = 1024 * 1024;
+
+    std::string zeroes(4096, 0);
+    uint64_t erase_size = std::min(kEraseSize, writer->Size());
+    for (uint64_t i = 0; i < erase_size; i += zeroes.size()) {
+        if (!writer->Write(zeroes.data(), zeroes.size())) {
+            PLOG(ERROR) << "write userdata_gsi";
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+    }
+    return INSTALL_OK;
+}
+
+// Run a tool, returning its exit status, or -1 if it could not be run.
+static int RunTool(const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.emplace_back(const_cast<char*>(arg.c_str()));
+    }
+    int status;
+    if (android_fork_execvp_ext(argv.size(), argv.data(), &status, true, LOG_ALOG, false, nullptr,
+                                nullptr, 0)) {
+        LOG(ERROR) << "could not run " << args[0];
+        return -1;
+    }
+    if (!WIFEXITED(status)) {
+        LOG(ERROR) << args[0] << " did not exit normally";
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+// Resize the filesystem on |device| to |size| bytes, or to fill the device if
+// |size| is 0. A device with no filesystem, such as one that is formatted
+// again on first boot, is left alone.
+static bool ResizeFilesystem(const std::string& device, uint64_t size = 0) {
+    unique_fd fd(open(device.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << device;
+        return false;
+    }
+    uint16_t ext4_magic;
+    uint32_t f2fs_magic;
+    if (!android::base::ReadFullyAtOffset(fd, &ext4_magic, sizeof(ext4_magic), kExt4MagicOffset) ||
+        !android::base::ReadFullyAtOffset(fd, &f2fs_magic, sizeof(f2fs_magic), kF2fsMagicOffset)) {
+        PLOG(ERROR) << "read " << device;
+        return false;
+    }
+    fd = {};
+
+    if (ext4_magic == kExt4Magic) {
+        // resize2fs insists on a freshly checked filesystem. e2fsck exits
+        // with 1 if it fixed something.
+        int rv = RunTool({"/system/bin/e2fsck", "-f", "-y", device});
+        if (rv != 0 && rv != 1) {
+            LOG(ERROR) << "e2fsck failed: " << rv;
+            return false;
+        }
+        std::vector<std::string> args = {"/system/bin/resize2fs", device};
+        if (size) {
+            args.emplace_back(std::to_string(size / 1024) + "K");
+        }
+        if (RunTool(args) != 0) {
+            LOG(ERROR) << "resize2fs failed";
+            return false;
+        }
+        return true;
+    }
+    if (f2fs_magic == kF2fsMagic) {
+        // f2fs can only shrink in safe mode, which checks that the data
+        // fits first.
+        std::vector<std::string> args = {"/system/bin/resize.f2fs"};
+        if (size) {
+            args.insert(args.end(), {"-s", "-t", std::to_string(size / LP_SECTOR_SIZE)});
+        }
+        args.emplace_back(device);
+        if (RunTool(args) != 0) {
+            LOG(ERROR) << "resize.f2fs failed";
+            return false;
+        }
+        return true;
+    }
+    LOG(INFO) << "no filesystem to resize on " << device;
+    return true;
+}
+
+// Change the size of userdata_gsi while keeping its contents. The GSI's
+// filesystem is resized along with it.
+int GsiService::ResizeUserdata(uint64_t new_size) {
+    // Note: this metadata is only used to recover the original partition sizes.
+    // We do not trust the extent information, which will get rebuilt later.
+    auto old_metadata = ReadFromImageFile(kGsiLpMetadataFile);
+    if (!old_metadata) {
+        LOG(ERROR) << "GSI install is incomplete";
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    install_dir_ = GetInstalledImageDir();
+    userdata_gsi_path_ = GetImagePath(install_dir_, "userdata_gsi");
+    system_gsi_path_ = GetImagePath(install_dir_, "system_gsi");
+    if (int error = DetermineReadWriteMethod()) {
+        return error;
+    }
+
+    // Both partitions are needed to rebuild the metadata.
+    Image userdata_image;
+    if (int error = GetExistingImage(*old_metadata.get(), "userdata_gsi", &userdata_image)) {
+        return error;
+    }
+    Image system_image;
+    if (int error = GetExistingImage(*old_metadata.get(), "system_gsi", &system_image)) {
+        return error;
+    }
+    partitions_.emplace(std::make_pair("system_gsi", std::move(system_image)));
+
+    uint64_t old_size = userdata_image.actual_size;
+    if (new_size == old_size) {
+        return INSTALL_OK;
+    }
+    if (new_size < old_size) {
+        return ShrinkUserdata(std::move(userdata_image), new_size);
+    }
+
+    StartAsyncOperation("grow userdata", new_size - old_size);
+    userdata_image.writer = nullptr;
+    int error;
+    userdata_image.writer = GrowFiemapWriter(userdata_gsi_path_, new_size, &error, true);
+    if (!userdata_image.writer) {
+        return error;
+    }
+    userdata_image.actual_size = new_size;
+    partitions_.emplace(std::make_pair("userdata_gsi", std::move(userdata_image)));
+
+    // The new space is only visible through device-mapper once the metadata
+    // includes it.
+    metadata_ = CreateMetadata();
+    if (!metadata_ || !CreateMetadataFile()) {
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    if (can_use_devicemapper_) {
+        std::string path;
+        if (!CreateLogicalPartition(kUserdataDevice, *metadata_.get(), "userdata_gsi", true,
+                                    kDmTimeout, &path)) {
+            LOG(ERROR) << "Error creating device-mapper node for userdata_gsi";
+            return INSTALL_ERROR_GENERIC;
+        }
+        if (!ResizeFilesystem(path)) {
+            return INSTALL_ERROR_GENERIC;
+        }
+    } else {
+        // The filesystem tools need a block device. This leaves the
+        // filesystem at its old size, which the GSI can still mount.
+        LOG(WARNING) << "cannot resize the userdata filesystem without device-mapper";
+    }
+    return INSTALL_OK;
+}
+
+// Shrink userdata_gsi: first the filesystem, while the whole image is still
+// mapped, then the metadata, and only then the image itself. The new extents
+// are a prefix of the old ones, so the saved metadata never maps blocks that
+// /data has freed, even if the image is left larger than it.
+int GsiService::ShrinkUserdata(Image&& userdata_image, uint64_t new_size) {
+    uint64_t block_size = userdata_image.writer->block_size();
+    if (new_size % block_size) {
+        LOG(ERROR) << "userdata size " << new_size << " is not a multiple of " << block_size;
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (!can_use_devicemapper_) {
+        LOG(ERROR) << "cannot shrink the userdata filesystem without device-mapper";
+        return INSTALL_ERROR_GENERIC;
+    }
+    partitions_.emplace(std::make_pair("userdata_gsi", std::move(userdata_image)));
+
+    StartAsyncOperation("shrink userdata", 0);
+    metadata_ = CreateMetadata();
+    if (!metadata_) {
+        return INSTALL_ERROR_GENERIC;
+    }
+    std::string path;
+    if (!CreateLogicalPartition(kUserdataDevice, *metadata_.get(), "userdata_gsi", true,
+                                kDmTimeout, &path)) {
+        LOG(ERROR) << "Error creating device-mapper node for userdata_gsi";
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (!ResizeFilesystem(path, new_size)) {
+        return INSTALL_ERROR_GENERIC;
+    }
+    // Nothing may map the blocks about to be released.
+    if (!DestroyLogicalPartition("userdata_gsi", kDmTimeout)) {
+        LOG(ERROR) << "could not unmap userdata_gsi";
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    partitions_["userdata_gsi"].actual_size = new_size;
+    metadata_ = CreateMetadata();
+    if (!metadata_ || !CreateMetadataFile()) {
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    partitions_.erase("userdata_gsi");
+    if (!ShrinkSplitImage(userdata_gsi_path_, new_size)) {
+        return INSTALL_ERROR_GENERIC;
+    }
+    return INSTALL_OK;
+}
+
+// Reads an installed image, either through its device-mapper node or from
+// the files backing it.
+class ImageReader final {
+  public:
+    bool OpenDevice(const std::string& path) {
+        path_ = path;
+        // Direct reads keep the page cache out of the way. They need aligned
+        // offsets and sizes, so a short tail is read normally.
+        direct_fd_.reset(open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_DIRECT));
+        unique_fd fd(open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+        if (fd < 0) {
+            PLOG(ERROR) << "open " << path;
+            return false;
+        }
+        pieces_.push_back({std::move(fd), UINT64_MAX});
+        return true;
+    }
+
+    // Open a list of files, to be read as if they were concatenated.
+    bool OpenFiles(const std::vector<std::string>& files) {
+        for (const auto& file : files) {
+            unique_fd fd(open(file.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+            if (fd < 0) {
+                PLOG(ERROR) << "open " << file;
+                return false;
+            }
+            struct stat s;
+            if (fstat(fd, &s)) {
+                PLOG(ERROR) << "fstat " << file;
+                return false;
+            }
+            pieces_.push_back({std::move(fd), static_cast<uint64_t>(s.st_size)});
+        }
+        return true;
+    }
+
+    // This is safe to call from several threads at once.
+    bool Read(void* data, size_t bytes, uint64_t offset) const {
+        if (direct_fd_ >= 0 && !(offset % kUringAlignment) && !(bytes % kUringAlignment)) {
+            if (!android::base::ReadFullyAtOffset(direct_fd_, data, bytes, offset)) {
+                PLOG(ERROR) << "read " << path_;
+                return false;
+            }
+            return true;
+        }
+
+        char* pos = reinterpret_cast<char*>(data);
+        for (const auto& piece : pieces_) {
+            if (!bytes) {
+                break;
+            }
+            if (offset >= piece.size) {
+                offset -= piece.size;
+                continue;
+            }
+            size_t to_read = std::min(static_cast<uint64_t>(bytes), piece.size - offset);
+            if (!android::base::ReadFullyAtOffset(piece.fd, pos, to_read, offset)) {
+                PLOG(ERROR) << "read image";
+                return false;
+            }
+            pos += to_read;
+            bytes -= to_read;
+            offset = 0;
+        }
+        if (bytes) {
+            LOG(ERROR) << "read past the end of split files";
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    struct Piece {
+        unique_fd fd;
+        uint64_t size;
+    };
+    std::string path_;
+    unique_fd direct_fd_;
+    std::vector<Piece> pieces_;
+};
+
+// Open an installed image for reading, the same way it was written: through
+// device-mapper (which is also how it will be booted), or through the
+// filesystem.
+int GsiService::OpenInstalledImage(const std::string& name, std::unique_ptr<ImageReader>* reader,
+                                   uint64_t* size) {
+    // Note: this metadata is only used to recover the original partition sizes.
+    // We do not trust the extent information, which will get rebuilt later.
+    auto old_metadata = ReadFromImageFile(kGsiLpMetadataFile);
+    if (!old_metadata) {
+        LOG(ERROR) << "GSI install is incomplete";
+        return INSTALL_ERROR_GENERIC;
     }
-    bool Flush() override {
-        return writer_->Flush();
+
+    install_dir_ = GetInstalledImageDir();
+    system_gsi_path_ = GetImagePath(install_dir_, "system_gsi");
+    if (int error = DetermineReadWriteMethod()) {
+        return error;
     }
-    uint64_t Size() override { return writer_->size(); }
 
-  private:
-    SplitFiemap* writer_;
-};
+    Image image;
+    if (int error = GetExistingImage(*old_metadata.get(), name, &image)) {
+        return error;
+    }
+    *size = image.actual_size;
+    partitions_.emplace(std::make_pair(name, std::move(image)));
 
-std::unique_ptr<GsiService::WriteHelper> GsiService::OpenPartition(const std::string& name) {
+    auto new_reader = std::make_unique<ImageReader>();
     if (can_use_devicemapper_) {
+        metadata_ = CreateMetadata();
+        if (!metadata_) {
+            return INSTALL_ERROR_GENERIC;
+        }
         std::string path;
-        if (!CreateLogicalPartition(kUserdataDevice, *metadata_.get(), name, true, kDmTimeout,
+        if (!CreateLogicalPartition(kUserdataDevice, *metadata_.get(), name, false, kDmTimeout,
                                     &path)) {
             LOG(ERROR) << "Error creating device-mapper node for " << name;
-            return {};
+            return INSTALL_ERROR_GENERIC;
         }
-
-        static const int kOpenFlags = O_RDWR | O_NOFOLLOW | O_CLOEXEC;
-        unique_fd fd(open(path.c_str(), kOpenFlags));
-        if (fd < 0) {
-            PLOG(ERROR) << "could not open " << path;
+        if (!new_reader->OpenDevice(path)) {
+            return INSTALL_ERROR_GENERIC;
+        }
+    } else {
+        auto image_path = GetImagePath(install_dir_, name);
+        std::vector<std::string> files;
+        if (!SplitFiemap::GetSplitFileList(image_path, &files) || !new_reader->OpenFiles(files)) {
+            LOG(ERROR) << "could not open " << image_path;
+            return INSTALL_ERROR_GENERIC;
         }
-        return std::make_unique<FdWriter>(GetImagePath(install_dir_, name), std::move(fd));
-    }
-
-    auto iter = partitions_.find(name);
-    if (iter == partitions_.end()) {
-        LOG(ERROR) << "could not find partition " << name;
-        return {};
     }
-    return std::make_unique<SplitFiemapWriter>(iter->second.writer.get());
+    *reader = std::move(new_reader);
+    return INSTALL_OK;
 }
 
-bool GsiService::CommitGsiChunk(int stream_fd, int64_t bytes) {
-    StartAsyncOperation("write gsi", gsi_size_);
-
-    if (bytes < 0) {
-        LOG(ERROR) << "chunk size " << bytes << " is negative";
-        return false;
-    }
-
-    auto buffer = std::make_unique<char[]>(system_block_size_);
+// Hash an installed image on several threads, reporting progress as |step|.
+bool GsiService::HashInstalledImage(const ImageReader& reader, uint64_t size,
+                                    const std::string& step, const ImageHashFn& hash) {
+    StartAsyncOperation(step, size);
 
+    std::mutex progress_lock;
     int progress = -1;
-    uint64_t remaining = bytes;
-    while (remaining) {
-        // :TODO: check file pin status!
-        size_t max_to_read = std::min(system_block_size_, remaining);
-        ssize_t rv = TEMP_FAILURE_RETRY(read(stream_fd, buffer.get(), max_to_read));
-        if (rv < 0) {
-            PLOG(ERROR) << "read gsi chunk";
-            return false;
-        }
-        if (rv == 0) {
-            LOG(ERROR) << "no bytes left in stream";
-            return false;
-        }
-        if (!CommitGsiChunk(buffer.get(), rv)) {
-            return false;
+    auto update_progress = [&](uint64_t bytes) -> bool {
+        // Only update the progress when the permille changes.
+        std::lock_guard<std::mutex> guard(progress_lock);
+        int new_progress = (bytes * 1000) / size;
+        if (new_progress > progress) {
+            progress = new_progress;
+            UpdateProgress(STATUS_WORKING, bytes);
         }
-        CHECK(static_cast<uint64_t>(rv) <= remaining);
-        remaining -= rv;
+        return !should_abort_;
+    };
+    auto read = [&reader](void* data, size_t bytes, uint64_t offset) -> bool {
+        return reader.Read(data, bytes, offset);
+    };
+    return hash(size, kVerifyThreads, read, update_progress);
+}
 
-        // Only update the progress when the % (or permille, in this case)
-        // significantly changes.
-        int new_progress = ((gsi_size_ - remaining) * 1000) / gsi_size_;
-        if (new_progress != progress) {
-            UpdateProgress(STATUS_WORKING, gsi_size_ - remaining);
+int GsiService::VerifyInstall(const std::string& given_digest) {
+    std::string expected_digest = android::base::Trim(given_digest);
+    if (expected_digest.empty()) {
+        if (!android::base::ReadFileToString(kGsiImageDigestFile, &expected_digest)) {
+            PLOG(ERROR) << "no digest was recorded for this install, one must be given";
+            return INSTALL_ERROR_GENERIC;
         }
+        expected_digest = android::base::Trim(expected_digest);
     }
-
-    UpdateProgress(STATUS_COMPLETE, gsi_size_);
-    return true;
-}
-
-bool GsiService::CommitGsiChunk(const void* data, size_t bytes) {
-    if (!installing_) {
-        LOG(ERROR) << "no gsi installation in progress";
-        return false;
+    std::transform(expected_digest.begin(), expected_digest.end(), expected_digest.begin(),
+                   ::tolower);
+    if (expected_digest.size() != SHA256_DIGEST_LENGTH * 2 ||
+        !std::all_of(expected_digest.begin(), expected_digest.end(), ::isxdigit)) {
+        LOG(ERROR) << "bad digest: " << expected_digest;
+        return INSTALL_ERROR_GENERIC;
     }
-    if (static_cast<uint64_t>(bytes) > gsi_size_ - gsi_bytes_written_) {
-        // We cannot write past the end of the image file.
-        LOG(ERROR) << "chunk size " << bytes << " exceeds remaining image size (" << gsi_size_
-                   << " expected, " << gsi_bytes_written_ << " written)";
-        return false;
+
+    std::unique_ptr<ImageReader> reader;
+    uint64_t size;
+    if (int error = OpenInstalledImage("system_gsi", &reader, &size)) {
+        return error;
     }
 
-    if (!system_writer_->Write(data, bytes)) {
-        PLOG(ERROR) << "write failed";
-        return false;
+    std::string digest;
+    auto hash = [&digest](uint64_t size, unsigned num_threads, const ImageReadFn& read,
+                          const ImageProgressFn& progress) -> bool {
+        return ComputeStripeDigest(size, num_threads, read, progress, &digest);
+    };
+    if (!HashInstalledImage(*reader.get(), size, "verify gsi", hash)) {
+        return INSTALL_ERROR_GENERIC;
     }
-    gsi_bytes_written_ += bytes;
-    return true;
+    if (digest != expected_digest) {
+        LOG(ERROR) << "system_gsi does not match: expected " << expected_digest << ", got "
+                   << digest;
+        return INSTALL_ERROR_VERIFICATION_FAILED;
+    }
+    LOG(INFO) << "system_gsi verified: " << digest;
+    return INSTALL_OK;
 }
 
-int GsiService::SetGsiBootable(bool one_shot) {
-    if (gsi_bytes_written_ != gsi_size_) {
-        // We cannot boot if the image is incomplete.
-        LOG(ERROR) << "image incomplete; expected " << gsi_size_ << " bytes, waiting for "
-                   << (gsi_size_ - gsi_bytes_written_) << " bytes";
-        return INSTALL_ERROR_GENERIC;
+// The manifest of an image is cached next to it until the image changes.
+std::string GsiService::GetManifestPath(const std::string& image_dir, const std::string& name) {
+    std::string dir = image_dir;
+    if (!android::base::EndsWith(dir, "/")) {
+        dir += "/";
     }
+    return dir + name + ".manifest";
+}
 
-    if (!system_writer_->Flush()) {
+// The manifest of system_gsi is written while the image is installed, and
+// cached until the image changes. userdata_gsi changes whenever the GSI runs,
+// so its manifest is always computed and never cached.
+int GsiService::GetBlockManifest(const std::string& name, unique_fd* manifest_fd) {
+    if (name != "system_gsi" && name != "userdata_gsi") {
+        LOG(ERROR) << "unknown image: " << name;
         return INSTALL_ERROR_GENERIC;
     }
 
-    // If files moved (are no longer pinned), the metadata file will be invalid.
-    for (const auto& [name, image] : partitions_) {
-        if (!image.writer->HasPinnedExtents()) {
-            LOG(ERROR) << name << " no longer has pinned extents";
+    auto manifest_path = GetManifestPath(GetInstalledImageDir(), name);
+    bool cached = name == "system_gsi";
+    if (cached) {
+        manifest_fd->reset(open(manifest_path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+        if (*manifest_fd >= 0) {
+            return INSTALL_OK;
+        }
+        if (errno != ENOENT) {
+            PLOG(ERROR) << "open " << manifest_path;
             return INSTALL_ERROR_GENERIC;
         }
     }
 
-    // Remember the installation directory.
-    if (!android::base::WriteStringToFile(install_dir_, kGsiInstallDirFile)) {
-        PLOG(ERROR) << "write failed: " << kGsiInstallDirFile;
-        return INSTALL_ERROR_GENERIC;
+    std::unique_ptr<ImageReader> reader;
+    uint64_t size;
+    if (int error = OpenInstalledImage(name, &reader, &size)) {
+        return error;
     }
 
-    // Note: create the install status file last, since this is the actual boot
-    // indicator.
-    if (!CreateMetadataFile() || !SetBootMode(one_shot) || !CreateInstallStatusFile()) {
+    std::string manifest;
+    auto hash = [&manifest](uint64_t size, unsigned num_threads, const ImageReadFn& read,
+                            const ImageProgressFn& progress) -> bool {
+        return ComputeBlockManifest(size, num_threads, read, progress, &manifest);
+    };
+    if (!HashInstalledImage(*reader.get(), size, "hash blocks", hash)) {
         return INSTALL_ERROR_GENERIC;
     }
-    return INSTALL_OK;
-}
 
-int GsiService::ReenableGsi(bool one_shot) {
-    if (!android::gsi::IsGsiInstalled()) {
-        LOG(ERROR) << "no gsi installed - cannot re-enable";
-        return INSTALL_ERROR_GENERIC;
+    if (!cached) {
+        // Hand back an anonymous file, which goes away once it is closed.
+        manifest_fd->reset(open(install_dir_.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600));
+        if (*manifest_fd < 0 || !android::base::WriteStringToFd(manifest, *manifest_fd) ||
+            lseek(*manifest_fd, 0, SEEK_SET) < 0) {
+            PLOG(ERROR) << "could not write the manifest of " << name;
+            return INSTALL_ERROR_GENERIC;
+        }
+        return INSTALL_OK;
     }
 
-    std::string boot_key;
-    if (!GetInstallStatus(&boot_key)) {
-        PLOG(ERROR) << "read " << kGsiInstallStatusFile;
+    if (!WriteFileAtomically(manifest_path, manifest)) {
         return INSTALL_ERROR_GENERIC;
     }
-    if (boot_key != kInstallStatusDisabled) {
-        LOG(ERROR) << "GSI is not currently disabled";
+    manifest_fd->reset(open(manifest_path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (*manifest_fd < 0) {
+        PLOG(ERROR) << "open " << manifest_path;
         return INSTALL_ERROR_GENERIC;
     }
+    return INSTALL_OK;
+}
 
-    if (IsGsiRunning()) {
-        if (!SetBootMode(one_shot) || !CreateInstallStatusFile()) {
-            return INSTALL_ERROR_GENERIC;
-        }
-        return INSTALL_OK;
-    }
+int GsiService::ApplyDelta(int stream_fd, uint64_t bytes) {
     // Note: this metadata is only used to recover the original partition sizes.
     // We do not trust the extent information, which will get rebuilt later.
     auto old_metadata = ReadFromImageFile(kGsiLpMetadataFile);
@@ -916,83 +3904,200 @@ int GsiService::ReenableGsi(bool one_shot) {
         return INSTALL_ERROR_GENERIC;
     }
 
-    // Set up enough installer state so that we can use various helper
-    // methods.
-    //
-    // TODO(dvander) Extract all of the installer state into a separate
-    // class so this is more manageable.
     install_dir_ = GetInstalledImageDir();
     system_gsi_path_ = GetImagePath(install_dir_, "system_gsi");
     if (int error = DetermineReadWriteMethod()) {
         return error;
     }
-
-    // Recover parition information.
-    Image userdata_image;
-    if (int error = GetExistingImage(*old_metadata.get(), "userdata_gsi", &userdata_image)) {
-        return error;
+    if (!can_use_devicemapper_) {
+        // Without device-mapper, the image can only be written sequentially.
+        LOG(ERROR) << "delta updates need device-mapper";
+        return INSTALL_ERROR_GENERIC;
     }
-    partitions_.emplace(std::make_pair("userdata_gsi", std::move(userdata_image)));
 
     Image system_image;
     if (int error = GetExistingImage(*old_metadata.get(), "system_gsi", &system_image)) {
         return error;
     }
+    uint64_t image_size = system_image.actual_size;
     partitions_.emplace(std::make_pair("system_gsi", std::move(system_image)));
 
     metadata_ = CreateMetadata();
     if (!metadata_) {
         return INSTALL_ERROR_GENERIC;
     }
-    if (!CreateMetadataFile() || !SetBootMode(one_shot) || !CreateInstallStatusFile()) {
+    system_writer_ = OpenPartition("system_gsi");
+    if (!system_writer_) {
         return INSTALL_ERROR_GENERIC;
     }
-    return INSTALL_OK;
-}
 
-int GsiService::WipeUserdata() {
-    // Note: this metadata is only used to recover the original partition sizes.
-    // We do not trust the extent information, which will get rebuilt later.
-    auto old_metadata = ReadFromImageFile(kGsiLpMetadataFile);
-    if (!old_metadata) {
-        LOG(ERROR) << "GSI install is incomplete";
+    // The stream is read with main_lock_ held, so a stalled client must not
+    // be able to block cancelGsiInstall().
+    auto aborted = [this]() -> bool { return should_abort_; };
+    std::vector<char> header(kDeltaHeaderSize);
+    if (bytes < header.size() ||
+        !ReadStreamFully(stream_fd, header.data(), header.size(), aborted, &install_report_)) {
+        LOG(ERROR) << "could not read the delta header";
         return INSTALL_ERROR_GENERIC;
     }
-
-    install_dir_ = GetInstalledImageDir();
-    system_gsi_path_ = GetImagePath(install_dir_, "system_gsi");
-    if (int error = DetermineReadWriteMethod()) {
+    DeltaHeader delta;
+    if (!DeltaDecoder::ParseHeader(header.data(), header.size(), &delta)) {
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (delta.image_size != image_size) {
+        LOG(ERROR) << "delta is for an image of " << delta.image_size
+                   << " bytes, but system_gsi has " << image_size << " bytes";
+        return INSTALL_ERROR_GENERIC;
+    }
+    if (int error = CheckDeltaSource(delta.source_digest)) {
         return error;
     }
 
-    // Recover parition information.
-    Image userdata_image;
-    if (int error = GetExistingImage(*old_metadata.get(), "userdata_gsi", &userdata_image)) {
-        return error;
+    // From here on the image is modified. Don't boot it until the whole
+    // delta has been applied.
+    std::string boot_key;
+    if (!GetInstallStatus(&boot_key)) {
+        PLOG(ERROR) << "read " << kGsiInstallStatusFile;
+        return INSTALL_ERROR_GENERIC;
     }
-    partitions_.emplace(std::make_pair("userdata_gsi", std::move(userdata_image)));
+    if (!DisableGsi()) {
+        PLOG(ERROR) << "could not write gsi status";
+        return INSTALL_ERROR_GENERIC;
+    }
+    android::base::RemoveFileIfExists(kGsiImageDigestFile);
+    android::base::RemoveFileIfExists(GetManifestPath(install_dir_, "system_gsi"));
 
-    metadata_ = CreateMetadata();
-    if (!metadata_) {
+    std::string path;
+    if (!DeviceMapper::Instance().GetDmDevicePathByName("system_gsi", &path)) {
+        LOG(ERROR) << "could not find device-mapper node for system_gsi";
+        return INSTALL_ERROR_GENERIC;
+    }
+    unique_fd read_fd(open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (read_fd < 0) {
+        PLOG(ERROR) << "open " << path;
         return INSTALL_ERROR_GENERIC;
     }
 
-    auto writer = OpenPartition("userdata_gsi");
-    if (!writer) {
-        return IGsiService::INSTALL_ERROR_GENERIC;
+    // COPY ops only read blocks that no earlier op wrote, so it does not
+    // matter whether the writer has finished writing everything yet.
+    std::vector<char> copy_buffer(kMinDefaultIoBufferSize);
+    // Seeking drains the writer's queue, so only seek when an op does not
+    // continue where the last one stopped. A DATA op usually arrives in
+    // several pieces.
+    uint64_t position = 0;
+    auto seek = [&, this](uint64_t offset, uint64_t length) -> bool {
+        if (offset != position && !system_writer_->Seek(offset)) {
+            return false;
+        }
+        position = offset + length;
+        return true;
+    };
+    auto write = [&, this](uint64_t offset, const void* data, uint64_t length) -> bool {
+        return seek(offset, length) && system_writer_->Write(data, length);
+    };
+    auto zero = [&, this](uint64_t offset, uint64_t length) -> bool {
+        return seek(offset, length) && system_writer_->WriteZeroes(length);
+    };
+    auto copy = [&, this](uint64_t source, uint64_t dest, uint64_t length) -> bool {
+        if (!seek(dest, length)) {
+            return false;
+        }
+        for (uint64_t done = 0; done < length;) {
+            size_t to_copy = std::min(static_cast<uint64_t>(copy_buffer.size()), length - done);
+            if (!android::base::ReadFullyAtOffset(read_fd, copy_buffer.data(), to_copy,
+                                                  source + done)) {
+                PLOG(ERROR) << "read " << path;
+                return false;
+            }
+            if (!system_writer_->Write(copy_buffer.data(), to_copy)) {
+                return false;
+            }
+            done += to_copy;
+        }
+        return true;
+    };
+    DeltaDecoder decoder(std::move(write), std::move(zero), std::move(copy));
+
+    StartAsyncOperation("apply delta", bytes);
+
+    auto buffer = std::make_unique<char[]>(kMinDefaultIoBufferSize);
+    uint64_t done = header.size();
+    bool ok = decoder.Decode(header.data(), header.size());
+    while (ok && done < bytes) {
+        if (should_abort_) {
+            LOG(ERROR) << "delta update was cancelled";
+            ok = false;
+            break;
+        }
+        size_t to_read = std::min(kMinDefaultIoBufferSize, bytes - done);
+        if (!ReadStreamFully(stream_fd, buffer.get(), to_read, aborted, &install_report_)) {
+            LOG(ERROR) << "read delta stream";
+            ok = false;
+            break;
+        }
+        ok = decoder.Decode(buffer.get(), to_read);
+        done += to_read;
+        UpdateProgress(STATUS_WORKING, done);
+    }
+    if (ok && !decoder.finished()) {
+        LOG(ERROR) << "delta stream ended early";
+        ok = false;
+    }
+    if (ok && !system_writer_->Flush()) {
+        ok = false;
+    }
+    if (!ok) {
+        LOG(ERROR) << "system_gsi was partially updated, the GSI must be reinstalled";
+        return INSTALL_ERROR_GENERIC;
     }
 
-    // Wipe the first 1MiB of the device, ensuring both the first block and
-    // the superblock are destroyed.
-    static constexpr uint64_t kEraseSize = 1024 * 1024;
+    if (!delta.target_digest.empty() &&
+        !android::base::WriteStringToFile(delta.target_digest, kGsiImageDigestFile)) {
+        PLOG(ERROR) << "write failed: " << kGsiImageDigestFile;
+    }
+    if (!android::base::WriteStringToFile(boot_key, kGsiInstallStatusFile)) {
+        PLOG(ERROR) << "write failed: " << kGsiInstallStatusFile;
+        return INSTALL_ERROR_GENERIC;
+    }
+    LOG(INFO) << "applied a delta of " << bytes << " bytes to system_gsi";
+    return INSTALL_OK;
+}
 
-    std::string zeroes(4096, 0);
-    uint64_t erase_size = std::min(kEraseSize, writer->Size());
-    for (uint64_t i = 0; i < erase_size; i += zeroes.size()) {
-        if (!writer->Write(zeroes.data(), zeroes.size())) {
-            PLOG(ERROR) << "write userdata_gsi";
-            return IGsiService::INSTALL_ERROR_GENERIC;
+// Make sure that system_gsi is the image a delta was made against. The
+// digest recorded when the image was installed is used if there is one;
+// otherwise the image is read back.
+int GsiService::CheckDeltaSource(const std::string& source_digest) {
+    if (source_digest.empty()) {
+        LOG(WARNING) << "delta does not name its source image, applying it unchecked";
+        return INSTALL_OK;
+    }
+
+    std::string digest;
+    if (android::base::ReadFileToString(kGsiImageDigestFile, &digest)) {
+        digest = android::base::Trim(digest);
+    } else {
+        std::string path;
+        if (!DeviceMapper::Instance().GetDmDevicePathByName("system_gsi", &path)) {
+            LOG(ERROR) << "could not find device-mapper node for system_gsi";
+            return INSTALL_ERROR_GENERIC;
+        }
+        ImageReader reader;
+        if (!reader.OpenDevice(path)) {
+            return INSTALL_ERROR_GENERIC;
         }
+        auto hash = [&digest](uint64_t size, unsigned num_threads, const ImageReadFn& read,
+                              const ImageProgressFn& progress) -> bool {
+            return ComputeStripeDigest(size, num_threads, read, progress, &digest);
+        };
+        uint64_t size = partitions_["system_gsi"].actual_size;
+        if (!HashInstalledImage(reader, size, "verify gsi", hash)) {
+            return INSTALL_ERROR_GENERIC;
+        }
+    }
+    if (digest != source_digest) {
+        LOG(ERROR) << "delta was made against " << source_digest << ", but system_gsi is "
+                   << digest;
+        return INSTALL_ERROR_VERIFICATION_FAILED;
     }
     return INSTALL_OK;
 }
@@ -1054,10 +4159,13 @@ bool GsiService::RemoveGsiFiles(const std::string& install_dir, bool wipeUserdat
     }
 
     std::vector<std::string> files{
+            GetManifestPath(install_dir, "system_gsi"),
             kGsiInstallStatusFile,
             kGsiLpMetadataFile,
             kGsiOneShotBootFile,
             kGsiInstallDirFile,
+            kGsiInstallCheckpointFile,
+            kGsiImageDigestFile,
     };
     for (const auto& file : files) {
         if (!android::base::RemoveFileIfExists(file, &message)) {
@@ -1157,20 +4265,20 @@ bool GsiService::FormatUserdata() {
 
 bool GsiService::AddPartitionFiemap(MetadataBuilder* builder, Partition* partition,
                                     const Image& image, const std::string& block_device) {
-    uint64_t sectors_needed = image.actual_size / LP_SECTOR_SIZE;
-    for (const auto& extent : image.writer->extents()) {
-        // :TODO: block size check for length, not sector size
-        if (extent.fe_length % LP_SECTOR_SIZE != 0) {
-            LOG(ERROR) << "Extent is not sector-aligned: " << extent.fe_length;
-            return false;
-        }
-        if (extent.fe_physical % LP_SECTOR_SIZE != 0) {
-            LOG(ERROR) << "Extent physical sector is not sector-aligned: " << extent.fe_physical;
-            return false;
-        }
+    const auto& extents = image.writer->extents();
+    std::vector<SectorRun> runs;
+    if (!CoalesceExtents(extents, &runs)) {
+        return false;
+    }
+    LOG(INFO) << partition->name() << ": coalesced " << extents.size() << " extents into "
+              << runs.size();
+    if (installing_) {
+        install_report_.SetExtents(partition->name(), runs.size());
+    }
 
-        uint64_t num_sectors =
-                std::min(static_cast<uint64_t>(extent.fe_length / LP_SECTOR_SIZE), sectors_needed);
+    uint64_t sectors_needed = image.actual_size / LP_SECTOR_SIZE;
+    for (const auto& run : runs) {
+        uint64_t num_sectors = std::min(run.num_sectors, sectors_needed);
         if (!num_sectors || !sectors_needed) {
             // This should never happen, but we include it just in case. It would
             // indicate that the last filesystem block had multiple extents.
@@ -1178,8 +4286,8 @@ bool GsiService::AddPartitionFiemap(MetadataBuilder* builder, Partition* partiti
             break;
         }
 
-        uint64_t physical_sector = extent.fe_physical / LP_SECTOR_SIZE;
-        if (!builder->AddLinearExtent(partition, block_device, num_sectors, physical_sector)) {
+        if (!builder->AddLinearExtent(partition, block_device, num_sectors,
+                                      run.physical_sector)) {
             LOG(ERROR) << "Could not add extent to lp metadata";
             return false;
         }
@@ -15,11 +15,16 @@
  */
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include <android-base/unique_fd.h>
@@ -27,12 +32,21 @@
 #include <binder/BinderService.h>
 #include <libfiemap_writer/split_fiemap_writer.h>
 #include <liblp/builder.h>
+#include "decompressor.h"
+#include "delta_decoder.h"
+#include "image_digest.h"
+#include "install_report.h"
 #include "libgsi/libgsi.h"
+#include "sparse_decoder.h"
 
 namespace android {
 namespace gsi {
 
-class GsiService : public BinderService<GsiService>, public BnGsiService {
+class ImageReader;
+
+class GsiService : public BinderService<GsiService>,
+                   public BnGsiService,
+                   public IBinder::DeathRecipient {
   public:
     static void Register();
 
@@ -42,11 +56,16 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     binder::Status startGsiInstall(int64_t gsiSize, int64_t userdataSize, bool wipeUserdata,
                                    int* _aidl_return) override;
     binder::Status beginGsiInstall(const GsiInstallParams& params, int* _aidl_return) override;
+    binder::Status resumeGsiInstall(const GsiInstallParams& params,
+                                    int64_t* _aidl_return) override;
     binder::Status commitGsiChunkFromStream(const ::android::os::ParcelFileDescriptor& stream,
                                             int64_t bytes, bool* _aidl_return) override;
     binder::Status getInstallProgress(::android::gsi::GsiProgress* _aidl_return) override;
     binder::Status commitGsiChunkFromMemory(const ::std::vector<uint8_t>& bytes,
                                             bool* _aidl_return) override;
+    binder::Status setGsiAshmem(const ::android::os::ParcelFileDescriptor& ashmem, int64_t size,
+                                bool* _aidl_return) override;
+    binder::Status commitGsiChunkFromAshmem(int64_t bytes, bool* _aidl_return) override;
     binder::Status cancelGsiInstall(bool* _aidl_return) override;
     binder::Status setGsiBootable(bool oneShot, int* _aidl_return) override;
     binder::Status isGsiEnabled(bool* _aidl_return) override;
@@ -59,6 +78,20 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     binder::Status getGsiBootStatus(int* _aidl_return) override;
     binder::Status getInstalledGsiImageDir(std::string* _aidl_return) override;
     binder::Status wipeGsiUserdata(int* _aidl_return) override;
+    binder::Status resizeGsiUserdata(int64_t newSize, int* _aidl_return) override;
+    binder::Status verifyGsiInstall(const std::string& expectedDigest,
+                                    int* _aidl_return) override;
+    binder::Status applyGsiDelta(const ::android::os::ParcelFileDescriptor& stream, int64_t bytes,
+                                 int* _aidl_return) override;
+    binder::Status getGsiBlockManifest(::android::os::ParcelFileDescriptor* _aidl_return) override;
+    binder::Status getImageBlockManifest(
+            const std::string& name, ::android::os::ParcelFileDescriptor* _aidl_return) override;
+    binder::Status registerProgressListener(const sp<IGsiProgressListener>& listener) override;
+    binder::Status unregisterProgressListener(const sp<IGsiProgressListener>& listener) override;
+    binder::Status getLastInstallReport(GsiInstallReport* _aidl_return) override;
+
+    // Drops the progress listeners of clients that have died.
+    void binderDied(const wp<IBinder>& who) override;
 
     static char const* getServiceName() { return kGsiServiceName; }
 
@@ -73,17 +106,58 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
         virtual bool Flush() = 0;
         virtual uint64_t Size() = 0;
 
+        // Move up to |bytes| from the pipe |fd| with splice(). This has the
+        // same return value and errno semantics as splice(). Writers that
+        // cannot splice fail with EOPNOTSUPP.
+        virtual ssize_t Splice(int /* fd */, size_t /* bytes */) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+
+        // Move to an absolute offset for the next write. Writers that
+        // cannot seek return false.
+        virtual bool Seek(uint64_t /* offset */) { return false; }
+
+        // Advance past |bytes| whose contents do not matter. By default
+        // this writes zeroes.
+        virtual bool Skip(uint64_t bytes);
+
+        // Write |bytes| of zeroes. Block device writers can do this without
+        // sending any data; by default, zeroes are written normally.
+        virtual bool WriteZeroes(uint64_t bytes);
+
+        // Record syscalls and write latencies in |report|.
+        void set_report(InstallReport* report) { report_ = report; }
+
         WriteHelper() = default;
         WriteHelper(const WriteHelper&) = delete;
         WriteHelper& operator=(const WriteHelper&) = delete;
         WriteHelper& operator=(WriteHelper&&) = delete;
         WriteHelper(WriteHelper&&) = delete;
+
+      protected:
+        // Write all of |data| to |fd| with write(), or with pwrite() at
+        // |offset| if it is not negative, recording each call.
+        bool WriteFd(int fd, const void* data, uint64_t bytes, int64_t offset);
+        // Record a syscall, and a write that completed after |latency|.
+        void ReportCall() {
+            if (report_) report_->AddWriteCall();
+        }
+        void ReportWrite(uint64_t bytes, InstallReport::Clock::duration latency) {
+            if (report_) report_->AddWrite(bytes, latency);
+        }
+
+        InstallReport* report_ = nullptr;
     };
 
   private:
     using LpMetadata = android::fs_mgr::LpMetadata;
     using MetadataBuilder = android::fs_mgr::MetadataBuilder;
     using SplitFiemap = android::fiemap_writer::SplitFiemap;
+    // Hashes an image with one of the functions in image_digest.h.
+    using ImageHashFn = std::function<bool(uint64_t size, unsigned num_threads,
+                                           const ImageReadFn& read,
+                                           const ImageProgressFn& progress)>;
 
     struct Image {
         std::unique_ptr<SplitFiemap> writer;
@@ -92,24 +166,55 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
 
     int ValidateInstallParams(GsiInstallParams* params);
     int StartInstall(const GsiInstallParams& params);
+    int64_t ResumeInstall(const GsiInstallParams& params);
     int PerformSanityChecks();
     int PreallocateFiles();
-    int PreallocateUserdata();
-    int PreallocateSystem();
+    int PreallocateUserdata(Image* image, bool* created);
+    int PreallocateSystem(Image* image);
     int DetermineReadWriteMethod();
     bool FormatUserdata();
+    uint64_t GetStreamBufferSize() const;
     bool CommitGsiChunk(int stream_fd, int64_t bytes);
+    bool SpliceGsiChunk(int stream_fd, uint64_t bytes, bool* unsupported);
+    bool PipelineGsiChunk(int stream_fd, uint64_t bytes);
     bool CommitGsiChunk(const void* data, size_t bytes);
+    bool WriteGsiData(const void* data, uint64_t bytes);
+    bool FillGsiData(uint32_t value, uint64_t bytes);
+    bool SkipGsiData(uint64_t bytes);
+    bool ZeroGsiData(uint64_t bytes);
+    bool WriteElidingZeroes(const char* data, uint64_t bytes);
+    void AddZeroedBytes(uint64_t bytes);
+    bool MapAshmem(int fd, int64_t size);
+    void UnmapAshmem();
+    bool CommitGsiChunkFromAshmem(int64_t bytes);
     int SetGsiBootable(bool one_shot);
     int ReenableGsi(bool one_shot);
     int WipeUserdata();
+    int ResizeUserdata(uint64_t new_size);
+    int ShrinkUserdata(Image&& userdata_image, uint64_t new_size);
+    int OpenInstalledImage(const std::string& name, std::unique_ptr<ImageReader>* reader,
+                           uint64_t* size);
+    bool HashInstalledImage(const ImageReader& reader, uint64_t size, const std::string& step,
+                            const ImageHashFn& hash);
+    int VerifyInstall(const std::string& expected_digest);
+    int GetBlockManifest(const std::string& name, android::base::unique_fd* manifest_fd);
+    int ApplyDelta(int stream_fd, uint64_t bytes);
+    int CheckDeltaSource(const std::string& source_digest);
     bool DisableGsiInstall();
     bool AddPartitionFiemap(android::fs_mgr::MetadataBuilder* builder,
                             android::fs_mgr::Partition* partition, const Image& image,
                             const std::string& block_device);
     std::unique_ptr<LpMetadata> CreateMetadata();
+    // If |report_progress| is set, allocation is reported as the progress of
+    // the current step.
     std::unique_ptr<SplitFiemap> CreateFiemapWriter(const std::string& path, uint64_t size,
-                                                    int* error);
+                                                    int* error, bool report_progress = false);
+    std::unique_ptr<SplitFiemap> GrowFiemapWriter(const std::string& path, uint64_t size,
+                                                  int* error, bool report_progress = false);
+    void MaybeWriteCheckpoint();
+    bool WriteCheckpoint();
+    bool ChecksumSystemImage(uint64_t offset, uint64_t bytes, bool resuming, uint32_t* checksum);
+    bool CheckImageDigest();
     bool CreateInstallStatusFile();
     bool CreateMetadataFile();
     bool SetBootMode(bool one_shot);
@@ -117,8 +222,15 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
 
     void StartAsyncOperation(const std::string& step, int64_t total_bytes);
     void UpdateProgress(int status, int64_t bytes_processed);
+    void SetProgressIoPath(int io_path);
+    GsiProgress GetProgress();
+    void SampleRate(int64_t bytes_processed);
+    void NotifyProgressListeners();
+    // Remove a listener by its binder. listener_lock_ must be held.
+    bool RemoveProgressListener(const IBinder* binder);
     int GetExistingImage(const LpMetadata& metadata, const std::string& name, Image* image);
     std::unique_ptr<WriteHelper> OpenPartition(const std::string& name);
+    std::unique_ptr<WriteHelper> OpenMeasuredPartition(const std::string& name);
 
     enum class AccessLevel {
         System,
@@ -130,6 +242,9 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     static std::string GetImagePath(const std::string& image_dir, const std::string& name);
     static std::string GetInstalledImagePath(const std::string& name);
     static std::string GetInstalledImageDir();
+    static std::string GetManifestPath(const std::string& image_dir, const std::string& name);
+
+    static int GetBootStatus();
 
     std::mutex main_lock_;
 
@@ -137,8 +252,9 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     // the userdata image if installation fails.
     bool wipe_userdata_on_failure_;
 
-    // These are initialized or set in StartInstall().
-    bool installing_ = false;
+    // These are initialized or set in StartInstall(). installing_ and
+    // userdata_size_ are also read by status queries, without main_lock_.
+    std::atomic<bool> installing_ = false;
     std::atomic<bool> should_abort_ = false;
     std::string install_dir_;
     std::string userdata_gsi_path_;
@@ -146,18 +262,92 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     uint64_t userdata_block_size_;
     uint64_t system_block_size_;
     uint64_t gsi_size_;
-    uint64_t userdata_size_;
+    std::atomic<uint64_t> userdata_size_ = 0;
     bool can_use_devicemapper_;
     bool wipe_userdata_;
+    // Requested size of each stream buffer, or 0 to pick one automatically.
+    uint64_t io_buffer_size_;
     // Remaining data we're waiting to receive for the GSI image.
     uint64_t gsi_bytes_written_;
+    // Part of gsi_bytes_written_ that was zeroed on disk rather than written.
+    uint64_t gsi_bytes_zeroed_;
+    // Running CRC32 of the first gsi_checksum_bytes_ of the image. Data that
+    // bypasses memory (splice() or zeroing) leaves it behind, until the next
+    // checkpoint reads that data back from the disk.
+    uint32_t gsi_checksum_;
+    uint64_t gsi_checksum_bytes_;
+    // Value of gsi_bytes_written_ when the last checkpoint was saved.
+    uint64_t last_checkpoint_;
+    // Whether the start of the stream has been checked for a sparse image
+    // header, and the decoder to use if one was found.
+    bool image_format_known_;
+    std::unique_ptr<SparseDecoder> sparse_decoder_;
+    // Set if the install stream is compressed.
+    std::unique_ptr<Decompressor> decompressor_;
+    // Hashes image data as it is written. It is dropped if some of the data
+    // can't be seen, such as with splice().
+    std::unique_ptr<ImageHasher> image_hasher_;
+    // Expected SHA-256 of the image in hex, or empty.
+    std::string expected_digest_;
+    // Digests in hex, once image_hasher_ has finished.
+    std::string image_digest_;
+    std::string image_stripe_digest_;
+    // False if the stripe digest may not match the data on disk, because
+    // parts of the image were skipped.
+    bool stripe_digest_valid_;
 
-    // Progress bar state.
-    std::mutex progress_lock_;
-    GsiProgress progress_;
+    // Progress bar state. Updates never take a lock, since every field is
+    // atomic. StartAsyncOperation() replaces the whole record, and keeps
+    // progress_seq_ odd while it does, so that readers can retry until they
+    // get a consistent snapshot.
+    std::atomic<uint32_t> progress_seq_ = 0;
+    std::atomic<const std::string*> progress_step_ = nullptr;
+    std::atomic<int> progress_status_ = STATUS_NO_OPERATION;
+    std::atomic<int64_t> progress_bytes_processed_ = 0;
+    std::atomic<int64_t> progress_total_bytes_ = 0;
+    std::atomic<int> progress_io_path_ = IO_PATH_NONE;
+    std::atomic<int64_t> progress_bytes_zeroed_ = 0;
+    // Steady clock times, in ns, at which the step started and completed.
+    std::atomic<int64_t> progress_start_ns_ = 0;
+    std::atomic<int64_t> progress_end_ns_ = 0;
+    // Serializes StartAsyncOperation() and guards progress_steps_, the
+    // interned step names. Entries are never removed, so progress_step_ may
+    // be read without the lock.
+    std::mutex progress_step_lock_;
+    std::unordered_set<std::string> progress_steps_;
+    // Throughput of the current step, as a moving average of samples taken
+    // in UpdateProgress(). UpdateProgress() only ever tries rate_lock_, and
+    // drops its sample if that fails, so that it never blocks.
+    std::mutex rate_lock_;
+    std::atomic<int64_t> rate_sample_ns_ = 0;
+    int64_t rate_sample_bytes_ = 0;
+    bool rate_known_ = false;
+    std::atomic<int64_t> rate_average_ = 0;
+
+    InstallReport install_report_;
+
+    // Clients that want progress pushed to them, and the thread that does
+    // it. The thread only runs while there are listeners, and sleeps while
+    // no operation is in progress.
+    std::mutex listener_lock_;
+    std::condition_variable listener_cv_;
+    std::vector<sp<IGsiProgressListener>> progress_listeners_;
+    std::thread notifier_thread_;
+    bool notifier_running_ = false;
+    bool stop_notifier_ = false;
 
     std::unique_ptr<WriteHelper> system_writer_;
 
+    // Shared memory ring set by setGsiAshmem(), and the offset of the next
+    // byte to consume from it.
+    void* ashmem_data_ = nullptr;
+    size_t ashmem_size_ = 0;
+    size_t ashmem_offset_ = 0;
+    // Private copy of the part of the ring being consumed, since the client
+    // can still write to the region.
+    std::unique_ptr<char[]> ashmem_copy_;
+    size_t ashmem_copy_size_ = 0;
+
     // This is used to track which GSI partitions have been created.
     std::map<std::string, Image> partitions_;
     std::unique_ptr<LpMetadata> metadata_;
@@ -15,9 +15,13 @@
 //
 
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <sysexits.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
 #include <condition_variable>
 #include <functional>
@@ -26,15 +30,21 @@
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
+#include <android-base/file.h>
 #include <android-base/parseint.h>
 #include <android-base/properties.h>
 #include <android-base/unique_fd.h>
+#include <android/gsi/BnGsiProgressListener.h>
 #include <android/gsi/IGsiService.h>
 #include <binder/IServiceManager.h>
+#include <binder/ProcessState.h>
 #include <cutils/android_reboot.h>
 #include <libgsi/libgsi.h>
 
+#include "sparse_decoder.h"
+
 using namespace android::gsi;
 using namespace std::chrono_literals;
 
@@ -46,15 +56,30 @@ static int Enable(sp<IGsiService> gsid, int argc, char** argv);
 static int Install(sp<IGsiService> gsid, int argc, char** argv);
 static int Wipe(sp<IGsiService> gsid, int argc, char** argv);
 static int WipeData(sp<IGsiService> gsid, int argc, char** argv);
+static int ResizeData(sp<IGsiService> gsid, int argc, char** argv);
+static int Verify(sp<IGsiService> gsid, int argc, char** argv);
+static int ApplyDelta(sp<IGsiService> gsid, int argc, char** argv);
+static int Manifest(sp<IGsiService> gsid, int argc, char** argv);
 static int Status(sp<IGsiService> gsid, int argc, char** argv);
 static int Cancel(sp<IGsiService> gsid, int argc, char** argv);
 
+static const std::map<std::string, int> kCompressionMap = {
+        {"none", IGsiService::COMPRESSION_NONE},
+        {"gzip", IGsiService::COMPRESSION_GZIP},
+        {"lz4", IGsiService::COMPRESSION_LZ4},
+        {"zstd", IGsiService::COMPRESSION_ZSTD},
+};
+
 static const std::map<std::string, CommandCallback> kCommandMap = {
         {"disable", Disable},
         {"enable", Enable},
         {"install", Install},
         {"wipe", Wipe},
         {"wipe-data", WipeData},
+        {"resize-data", ResizeData},
+        {"verify", Verify},
+        {"apply-delta", ApplyDelta},
+        {"manifest", Manifest},
         {"status", Status},
         {"cancel", Cancel},
 };
@@ -93,33 +118,85 @@ class ProgressBar {
   public:
     explicit ProgressBar(sp<IGsiService> gsid) : gsid_(gsid) {}
 
-    ~ProgressBar() { Stop(); }
+    ~ProgressBar() {
+        Stop();
+        if (listener_) {
+            listener_->Detach();
+            gsid_->unregisterProgressListener(listener_);
+        }
+    }
 
     void Display() {
         Finish();
-        done_ = false;
-        last_update_ = {};
-        worker_ = std::make_unique<std::thread>([this]() { Worker(); });
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            done_ = false;
+            last_update_ = {};
+        }
+        active_ = true;
+
+        // Prefer updates pushed by gsid, and poll if it cannot send them.
+        if (!listener_) {
+            sp<Listener> listener = new Listener(this);
+            if (gsid_->registerProgressListener(listener).isOk()) {
+                listener_ = listener;
+            }
+        }
+        if (!listener_) {
+            worker_ = std::make_unique<std::thread>([this]() { Worker(); });
+        }
     }
 
     void Stop() {
-        if (!worker_) {
-            return;
-        }
         SignalDone();
-        worker_->join();
-        worker_ = nullptr;
+        if (worker_) {
+            worker_->join();
+            worker_ = nullptr;
+        }
     }
 
     void Finish() {
-        if (!worker_) {
+        if (!active_) {
             return;
         }
         Stop();
+        std::lock_guard<std::mutex> guard(mutex_);
         FinishLastBar();
+        active_ = false;
     }
 
   private:
+    // Receives updates from gsid on a binder thread, for as long as the bar
+    // it was made for exists.
+    class Listener : public BnGsiProgressListener {
+      public:
+        explicit Listener(ProgressBar* bar) : bar_(bar) {}
+
+        android::binder::Status onProgress(const GsiProgress& progress) override {
+            std::lock_guard<std::mutex> guard(lock_);
+            if (bar_) {
+                bar_->OnProgress(progress);
+            }
+            return android::binder::Status::ok();
+        }
+
+        void Detach() {
+            std::lock_guard<std::mutex> guard(lock_);
+            bar_ = nullptr;
+        }
+
+      private:
+        std::mutex lock_;
+        ProgressBar* bar_;
+    };
+
+    void OnProgress(const GsiProgress& progress) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (!done_) {
+            Show(progress);
+        }
+    }
+
     void Worker() {
         std::unique_lock<std::mutex> lock(mutex_);
         while (!done_) {
@@ -137,14 +214,18 @@ class ProgressBar {
             std::cout << std::endl;
             return false;
         }
+        Show(latest);
+        return true;
+    }
+
+    void Show(const GsiProgress& latest) {
         if (latest.status == IGsiService::STATUS_NO_OPERATION) {
-            return true;
+            return;
         }
         if (last_update_.step != latest.step) {
             FinishLastBar();
         }
         Display(latest);
-        return true;
     }
 
     void FinishLastBar() {
@@ -154,8 +235,17 @@ class ProgressBar {
         }
         // Ensure we finish the display at 100%.
         last_update_.bytes_processed = last_update_.total_bytes;
+        last_update_.eta_ms = 0;
         Display(last_update_);
         std::cout << std::endl;
+        last_update_ = {};
+    }
+
+    // Format a duration as minutes and seconds.
+    static std::string FormatDuration(int64_t ms) {
+        int64_t seconds = (ms + 999) / 1000;
+        return std::to_string(seconds / 60) + ":" + (seconds % 60 < 10 ? "0" : "") +
+               std::to_string(seconds % 60);
     }
 
     void Display(const GsiProgress& progress) {
@@ -167,6 +257,7 @@ class ProgressBar {
         static constexpr char kRedColor[] = "\x1b[31m";
         static constexpr char kGreenColor[] = "\x1b[32m";
         static constexpr char kResetColor[] = "\x1b[0m";
+        static constexpr char kClearToEnd[] = "\x1b[K";
 
         int percentage = (progress.bytes_processed * 100) / progress.total_bytes;
         int64_t bytes_per_col = progress.total_bytes / kColumns;
@@ -183,6 +274,17 @@ class ProgressBar {
         fprintf(stdout, "\r%-15s%6d%% ", progress.step.c_str(), percentage);
         fprintf(stdout, "%s[%s%s%s", kGreenColor, fills.c_str(), kRedColor, dashes.c_str());
         fprintf(stdout, "%s]%s", kGreenColor, kResetColor);
+        // A stalled transfer shows up as a falling rate with no ETA.
+        if (progress.bytes_per_second > 0) {
+            fprintf(stdout, " %.1f MiB/s", progress.bytes_per_second / (1024.0 * 1024.0));
+        }
+        if (progress.elapsed_ms > 0) {
+            fprintf(stdout, " %s", FormatDuration(progress.elapsed_ms).c_str());
+        }
+        if (progress.eta_ms > 0) {
+            fprintf(stdout, " ETA %s", FormatDuration(progress.eta_ms).c_str());
+        }
+        fprintf(stdout, "%s", kClearToEnd);
         fflush(stdout);
 
         last_update_ = progress;
@@ -196,18 +298,44 @@ class ProgressBar {
 
   private:
     sp<IGsiService> gsid_;
+    sp<Listener> listener_;
     std::unique_ptr<std::thread> worker_;
     std::condition_variable cv_;
+    // Guards everything below, which the listener touches from binder
+    // threads.
     std::mutex mutex_;
     GsiProgress last_update_;
     bool done_ = false;
+    bool active_ = false;
 };
 
+// Advance past the part of the image that an interrupted install already
+// wrote. Pipes can't seek, so fall back to reading and discarding.
+static bool SkipInput(int fd, int64_t bytes) {
+    if (!bytes || lseek64(fd, bytes, SEEK_CUR) >= 0) {
+        return true;
+    }
+    char buffer[65536];
+    while (bytes > 0) {
+        size_t to_read = std::min(static_cast<int64_t>(sizeof(buffer)), bytes);
+        if (!android::base::ReadFully(fd, buffer, to_read)) {
+            return false;
+        }
+        bytes -= to_read;
+    }
+    return true;
+}
+
 static int Install(sp<IGsiService> gsid, int argc, char** argv) {
     struct option options[] = {
+            {"compressed-size", required_argument, nullptr, 'z'},
+            {"compression", required_argument, nullptr, 'c'},
             {"install-dir", required_argument, nullptr, 'i'},
             {"gsi-size", required_argument, nullptr, 's'},
+            {"io-buffer-size", required_argument, nullptr, 'b'},
             {"no-reboot", no_argument, nullptr, 'n'},
+            {"resume", no_argument, nullptr, 'r'},
+            {"sha256", required_argument, nullptr, 'h'},
             {"userdata-size", required_argument, nullptr, 'u'},
             {"wipe", no_argument, nullptr, 'w'},
             {nullptr, 0, nullptr, 0},
@@ -217,7 +345,11 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
     params.gsiSize = 0;
     params.userdataSize = 0;
     params.wipeUserdata = false;
+    params.ioBufferSize = 0;
+    params.compression = IGsiService::COMPRESSION_NONE;
+    int64_t compressed_size = 0;
     bool reboot = true;
+    bool resume = false;
 
     if (getuid() != 0) {
         std::cerr << "must be root to install a GSI" << std::endl;
@@ -240,6 +372,31 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
                     return EX_USAGE;
                 }
                 break;
+            case 'b':
+                if (!android::base::ParseInt(optarg, &params.ioBufferSize) ||
+                    params.ioBufferSize <= 0) {
+                    std::cerr << "Could not parse I/O buffer size: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            case 'c': {
+                auto iter = kCompressionMap.find(optarg);
+                if (iter == kCompressionMap.end()) {
+                    std::cerr << "Unknown compression type: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                params.compression = iter->second;
+                break;
+            }
+            case 'z':
+                if (!android::base::ParseInt(optarg, &compressed_size) || compressed_size <= 0) {
+                    std::cerr << "Could not parse compressed size: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            case 'h':
+                params.expectedDigest = optarg;
+                break;
             case 'i':
                 params.installDir = optarg;
                 break;
@@ -249,6 +406,9 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
             case 'n':
                 reboot = false;
                 break;
+            case 'r':
+                resume = true;
+                break;
         }
     }
 
@@ -256,6 +416,11 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
         std::cerr << "Must specify --gsi-size." << std::endl;
         return EX_USAGE;
     }
+    bool compressed = (params.compression != IGsiService::COMPRESSION_NONE);
+    if (compressed != (compressed_size > 0)) {
+        std::cerr << "--compressed-size must be used together with --compression." << std::endl;
+        return EX_USAGE;
+    }
 
     bool running_gsi = false;
     gsid->isGsiRunning(&running_gsi);
@@ -271,22 +436,80 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
         return EX_SOFTWARE;
     }
 
+    // Sparse images are expanded by gsid, so --gsi-size is the size of the
+    // stream and the size of the image comes from the sparse header. Since
+    // the input can't be rewound, the header is forwarded separately below.
+    // Compressed streams are passed through untouched; gsid looks for a
+    // sparse header after decompressing them. Since the images are allocated
+    // before that, --gsi-size must then already be the expanded size.
+    int64_t stream_size = compressed ? compressed_size : params.gsiSize;
+    size_t header_bytes = compressed ? 0 : kSparseHeaderSize;
+    std::vector<uint8_t> header(std::min(static_cast<int64_t>(header_bytes), stream_size));
+    if (!android::base::ReadFully(input, header.data(), header.size())) {
+        std::cerr << "Could not read image header: " << strerror(errno) << std::endl;
+        return EX_SOFTWARE;
+    }
+    uint64_t image_size;
+    bool sparse = SparseDecoder::IsSparse(header.data(), header.size(), &image_size);
+    if (sparse) {
+        if (!image_size || image_size > INT64_MAX) {
+            std::cerr << "Invalid sparse image size: " << image_size << std::endl;
+            return EX_SOFTWARE;
+        }
+        params.gsiSize = image_size;
+        std::cout << "Installing sparse image of " << image_size << " bytes." << std::endl;
+    }
+
     // Note: the progress bar needs to be re-started in between each call.
     ProgressBar progress(gsid);
     progress.Display();
 
     int error;
-    auto status = gsid->beginGsiInstall(params, &error);
-    if (!status.isOk() || error != IGsiService::INSTALL_OK) {
-        std::cerr << "Could not start live image install: " << ErrorMessage(status, error) << "\n";
-        return EX_SOFTWARE;
+    int64_t offset = 0;
+    android::binder::Status status;
+    if (resume) {
+        status = gsid->resumeGsiInstall(params, &offset);
+        if (!status.isOk() || offset < 0) {
+            std::cerr << "Could not resume live image install: " << ErrorMessage(status) << "\n";
+            return EX_SOFTWARE;
+        }
+        if (sparse && offset) {
+            std::cerr << "Cannot resume a raw image install with a sparse image." << std::endl;
+            return EX_SOFTWARE;
+        }
+        std::cout << "Resuming at offset " << offset << "." << std::endl;
+    } else {
+        status = gsid->beginGsiInstall(params, &error);
+        if (!status.isOk() || error != IGsiService::INSTALL_OK) {
+            std::cerr << "Could not start live image install: " << ErrorMessage(status, error)
+                      << "\n";
+            return EX_SOFTWARE;
+        }
+    }
+
+    bool ok = false;
+    int64_t header_size = header.size();
+    if (offset < header_size) {
+        std::vector<uint8_t> data(header.begin() + offset, header.end());
+        status = gsid->commitGsiChunkFromMemory(data, &ok);
+        if (!ok) {
+            std::cerr << "Could not commit live image data: " << ErrorMessage(status) << "\n";
+            return EX_SOFTWARE;
+        }
+        stream_size -= header_size;
+    } else {
+        if (!SkipInput(input, offset - header_size)) {
+            std::cerr << "Could not skip " << offset << " bytes of input: " << strerror(errno)
+                      << std::endl;
+            return EX_SOFTWARE;
+        }
+        stream_size -= offset;
     }
 
     android::os::ParcelFileDescriptor stream(std::move(input));
 
-    bool ok = false;
     progress.Display();
-    status = gsid->commitGsiChunkFromStream(stream, params.gsiSize, &ok);
+    status = gsid->commitGsiChunkFromStream(stream, stream_size, &ok);
     if (!ok) {
         std::cerr << "Could not commit live image data: " << ErrorMessage(status) << "\n";
         return EX_SOFTWARE;
@@ -369,11 +592,73 @@ static int WipeData(sp<IGsiService> gsid, int argc, char** /* argv */) {
     return 0;
 }
 
-static int Status(sp<IGsiService> gsid, int argc, char** /* argv */) {
-    if (argc > 1) {
+static int ShowInstallReport(sp<IGsiService> gsid) {
+    GsiInstallReport report;
+    auto status = gsid->getLastInstallReport(&report);
+    if (!status.isOk()) {
+        std::cerr << "error: " << status.exceptionMessage().string() << std::endl;
+        return EX_SOFTWARE;
+    }
+    if (report.phases.empty()) {
+        std::cout << "No install since gsid started." << std::endl;
+        return 0;
+    }
+
+    std::cout << "Last install:" << std::endl;
+    for (const auto& phase : report.phases) {
+        printf("  %-28s %10.1f ms  x%d\n", phase.name.c_str(), phase.durationUs / 1000.0,
+               phase.count);
+    }
+    printf("  read calls      %" PRId64 "\n", report.readCalls);
+    printf("  write calls     %" PRId64 "\n", report.writeCalls);
+    printf("  bytes written   %" PRId64 "\n", report.bytesWritten);
+    printf("  bytes skipped   %" PRId64 "\n", report.bytesSkipped);
+    printf("  bytes zeroed    %" PRId64 "\n", report.bytesZeroed);
+    printf("  system extents  %d\n", report.systemExtents);
+    printf("  userdata extents %d\n", report.userdataExtents);
+    std::cout << "  write latency:" << std::endl;
+    for (size_t i = 0; i < report.writeLatencyCounts.size(); i++) {
+        if (!report.writeLatencyCounts[i]) {
+            continue;
+        }
+        if (i + 1 == report.writeLatencyCounts.size()) {
+            printf("    >= %8" PRId64 " us  %" PRId64 "\n", report.writeLatencyBoundsUs[i - 1],
+                   report.writeLatencyCounts[i]);
+        } else {
+            printf("    <  %8" PRId64 " us  %" PRId64 "\n", report.writeLatencyBoundsUs[i],
+                   report.writeLatencyCounts[i]);
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+static int Status(sp<IGsiService> gsid, int argc, char** argv) {
+    struct option options[] = {
+            {"perf", no_argument, nullptr, 'p'},
+            {nullptr, 0, nullptr, 0},
+    };
+
+    bool perf = false;
+    int rv, index;
+    while ((rv = getopt_long_only(argc, argv, "", options, &index)) != -1) {
+        switch (rv) {
+            case 'p':
+                perf = true;
+                break;
+            default:
+                std::cerr << "Unrecognized arguments to status." << std::endl;
+                return EX_USAGE;
+        }
+    }
+    if (optind < argc) {
         std::cerr << "Unrecognized arguments to status." << std::endl;
         return EX_USAGE;
     }
+    if (perf) {
+        return ShowInstallReport(gsid);
+    }
+
     bool running;
     auto status = gsid->isGsiRunning(&running);
     if (!status.isOk()) {
@@ -460,6 +745,174 @@ static int Enable(sp<IGsiService> gsid, int argc, char** argv) {
     return 0;
 }
 
+static int ResizeData(sp<IGsiService> gsid, int argc, char** argv) {
+    struct option options[] = {
+            {"userdata-size", required_argument, nullptr, 'u'},
+            {nullptr, 0, nullptr, 0},
+    };
+
+    int64_t userdata_size = 0;
+    int rv, index;
+    while ((rv = getopt_long_only(argc, argv, "", options, &index)) != -1) {
+        switch (rv) {
+            case 'u':
+                if (!android::base::ParseInt(optarg, &userdata_size) || userdata_size <= 0) {
+                    std::cerr << "Could not parse image size: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            default:
+                std::cerr << "Unrecognized argument to resize-data\n";
+                return EX_USAGE;
+        }
+    }
+    if (!userdata_size) {
+        std::cerr << "Must specify --userdata-size.\n";
+        return EX_USAGE;
+    }
+
+    ProgressBar progress(gsid);
+    progress.Display();
+
+    int error;
+    auto status = gsid->resizeGsiUserdata(userdata_size, &error);
+    progress.Finish();
+    if (!status.isOk() || error != IGsiService::INSTALL_OK) {
+        std::cerr << "Could not resize GSI userdata: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    std::cout << "GSI userdata resized to " << userdata_size << " bytes." << std::endl;
+    return 0;
+}
+
+static int Verify(sp<IGsiService> gsid, int argc, char** argv) {
+    struct option options[] = {
+            {"digest", required_argument, nullptr, 'd'},
+            {nullptr, 0, nullptr, 0},
+    };
+
+    std::string digest;
+    int rv, index;
+    while ((rv = getopt_long_only(argc, argv, "", options, &index)) != -1) {
+        switch (rv) {
+            case 'd':
+                digest = optarg;
+                break;
+            default:
+                std::cerr << "Unrecognized argument to verify\n";
+                return EX_USAGE;
+        }
+    }
+
+    ProgressBar progress(gsid);
+    progress.Display();
+
+    int error;
+    auto status = gsid->verifyGsiInstall(digest, &error);
+    progress.Finish();
+    if (status.isOk() && error == IGsiService::INSTALL_ERROR_VERIFICATION_FAILED) {
+        std::cerr << "The installed GSI does not match the expected digest.\n";
+        return EX_SOFTWARE;
+    }
+    if (!status.isOk() || error != IGsiService::INSTALL_OK) {
+        std::cerr << "Could not verify the installed GSI: " << ErrorMessage(status, error)
+                  << "\n";
+        return EX_SOFTWARE;
+    }
+    std::cout << "The installed GSI matches the expected digest." << std::endl;
+    return 0;
+}
+
+static int ApplyDelta(sp<IGsiService> gsid, int argc, char** argv) {
+    struct option options[] = {
+            {"delta-size", required_argument, nullptr, 's'},
+            {nullptr, 0, nullptr, 0},
+    };
+
+    int64_t delta_size = 0;
+    int rv, index;
+    while ((rv = getopt_long_only(argc, argv, "", options, &index)) != -1) {
+        switch (rv) {
+            case 's':
+                if (!android::base::ParseInt(optarg, &delta_size) || delta_size <= 0) {
+                    std::cerr << "Could not parse delta size: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            default:
+                std::cerr << "Unrecognized argument to apply-delta\n";
+                return EX_USAGE;
+        }
+    }
+
+    if (getuid() != 0) {
+        std::cerr << "must be root to update a GSI" << std::endl;
+        return EX_NOPERM;
+    }
+
+    android::base::unique_fd input(dup(1));
+    if (input < 0) {
+        std::cerr << "Error duplicating descriptor: " << strerror(errno) << std::endl;
+        return EX_SOFTWARE;
+    }
+    if (!delta_size) {
+        struct stat s;
+        if (fstat(input, &s) || !S_ISREG(s.st_mode) || !s.st_size) {
+            std::cerr << "Must specify --delta-size unless the delta is a regular file.\n";
+            return EX_USAGE;
+        }
+        delta_size = s.st_size;
+    }
+
+    ProgressBar progress(gsid);
+    progress.Display();
+
+    int error;
+    android::os::ParcelFileDescriptor stream(std::move(input));
+    auto status = gsid->applyGsiDelta(stream, delta_size, &error);
+    progress.Finish();
+    if (status.isOk() && error == IGsiService::INSTALL_ERROR_VERIFICATION_FAILED) {
+        std::cerr << "The installed GSI is not the image this delta applies to.\n";
+        return EX_SOFTWARE;
+    }
+    if (!status.isOk() || error != IGsiService::INSTALL_OK) {
+        std::cerr << "Could not apply the delta: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    std::cout << "Delta applied. Please reboot to use the updated GSI." << std::endl;
+    return 0;
+}
+
+static int Manifest(sp<IGsiService> gsid, int argc, char** argv) {
+    if (argc > 2) {
+        std::cerr << "Unrecognized arguments to manifest.\n";
+        return EX_USAGE;
+    }
+    std::string name = argc > 1 ? argv[1] : "system_gsi";
+
+    // The manifest goes to stdout, so the progress bar would corrupt it.
+    android::os::ParcelFileDescriptor manifest;
+    auto status = gsid->getImageBlockManifest(name, &manifest);
+    if (!status.isOk()) {
+        std::cerr << "Could not get the block manifest: " << ErrorMessage(status) << "\n";
+        return EX_SOFTWARE;
+    }
+
+    char buffer[65536];
+    ssize_t n;
+    while ((n = TEMP_FAILURE_RETRY(read(manifest.get(), buffer, sizeof(buffer)))) > 0) {
+        if (!android::base::WriteFully(STDOUT_FILENO, buffer, n)) {
+            std::cerr << "Could not write the block manifest: " << strerror(errno) << std::endl;
+            return EX_SOFTWARE;
+        }
+    }
+    if (n < 0) {
+        std::cerr << "Could not read the block manifest: " << strerror(errno) << std::endl;
+        return EX_SOFTWARE;
+    }
+    return 0;
+}
+
 static int Disable(sp<IGsiService> gsid, int argc, char** /* argv */) {
     if (argc > 1) {
         std::cerr << "Unrecognized arguments to disable." << std::endl;
@@ -496,16 +949,43 @@ static int usage(int /* argc */, char* argv[]) {
             "  install      Install a new GSI. Specify the image size with\n"
             "               --gsi-size and the desired userdata size with\n"
             "               --userdata-size (the latter defaults to 8GiB)\n"
+            "               Android sparse images are detected automatically;\n"
+            "               for those, --gsi-size is the size of the sparse file\n"
             "               --wipe (remove old gsi userdata first)\n"
+            "               --io-buffer-size (bytes per read/write, default 1-4MiB)\n"
+            "               --resume (continue an interrupted install of the same\n"
+            "               image; the full image must still be supplied)\n"
+            "               --compression=<gzip|lz4|zstd> with --compressed-size\n"
+            "               (the input is compressed; --gsi-size is the size\n"
+            "               of the image once installed, which for a compressed\n"
+            "               sparse image is its expanded size, not the size of\n"
+            "               the sparse file)\n"
+            "               --sha256=<digest> (fail unless the image written has\n"
+            "               this SHA-256; for sparse images, the digest of the\n"
+            "               simg2img output)\n"
+            "  apply-delta  Update the installed GSI in place from a delta on\n"
+            "               stdin (--delta-size, optional for regular files)\n"
+            "  manifest [system_gsi|userdata_gsi]\n"
+            "               Write the block hashes of an installed image to\n"
+            "               stdout, for building a delta against it\n"
             "  wipe         Completely remove a GSI and its associated data\n"
             "  wipe-data    Ensure the GSI's userdata will be formatted\n"
+            "  resize-data  Grow or shrink the GSI's userdata to --userdata-size\n"
+            "               bytes, keeping its contents\n"
+            "  verify       Read back the installed GSI and check its stripe\n"
+            "               digest (--digest=<hex>, defaults to the digest\n"
+            "               recorded during install)\n"
             "  cancel       Cancel the installation\n"
-            "  status       Show status\n",
+            "  status       Show status, or with --perf, timings and I/O counts\n"
+            "               for the last install\n",
             argv[0], argv[0]);
     return EX_USAGE;
 }
 
 int main(int argc, char** argv) {
+    // Progress updates from gsid arrive on binder threads.
+    android::ProcessState::self()->startThreadPool();
+
     auto gsid = GetGsiService();
     if (!gsid) {
         std::cerr << "Could not connect to the gsid service." << std::endl;
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "image_digest.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include <android-base/logging.h>
+
+namespace android {
+namespace gsi {
+
+// Data waiting to be hashed is copied, so put a bound on it.
+static constexpr size_t kMaxQueuedBytes = 64 * 1024 * 1024;
+static constexpr size_t kZeroBufferSize = 1024 * 1024;
+// Stripes are read in pieces of this size. The buffers are aligned so that
+// they can be used with O_DIRECT.
+static constexpr size_t kStripeReadSize = 1024 * 1024;
+static constexpr size_t kStripeReadAlignment = 4096;
+
+std::string DigestToHex(const uint8_t* digest, size_t size) {
+    static constexpr char kHexDigits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < size; i++) {
+        hex.push_back(kHexDigits[digest[i] >> 4]);
+        hex.push_back(kHexDigits[digest[i] & 0xf]);
+    }
+    return hex;
+}
+
+// Called, in order within each stripe, with each piece of the image that is
+// read. |last| is set for the final piece of a stripe.
+using StripeDataFn = std::function<void(uint64_t stripe, uint64_t offset, const char* data,
+                                        size_t bytes, bool last)>;
+
+// Read an image of |size| bytes on |num_threads| threads, handing the data
+// to |consume|.
+static bool ReadStripes(uint64_t size, unsigned num_threads, const ImageReadFn& read,
+                        const ImageProgressFn& progress, const StripeDataFn& consume) {
+    uint64_t num_stripes = (size + kDigestStripeSize - 1) / kDigestStripeSize;
+
+    // Each thread takes the next stripe that nobody has started on, so that
+    // the threads read disjoint ranges.
+    std::atomic<uint64_t> next_stripe = 0;
+    std::atomic<uint64_t> bytes_done = 0;
+    std::atomic<bool> failed = false;
+    auto worker = [&]() -> void {
+        void* buffer;
+        if (posix_memalign(&buffer, kStripeReadAlignment, kStripeReadSize)) {
+            LOG(ERROR) << "could not allocate read buffer";
+            failed = true;
+            return;
+        }
+        std::unique_ptr<char, decltype(&free)> holder(reinterpret_cast<char*>(buffer), &free);
+
+        uint64_t stripe;
+        while (!failed && (stripe = next_stripe++) < num_stripes) {
+            uint64_t start = stripe * kDigestStripeSize;
+            uint64_t end = std::min(size, start + kDigestStripeSize);
+            for (uint64_t offset = start; offset < end;) {
+                size_t bytes = std::min(static_cast<uint64_t>(kStripeReadSize), end - offset);
+                if (!read(buffer, bytes, offset)) {
+                    failed = true;
+                    return;
+                }
+                consume(stripe, offset, reinterpret_cast<const char*>(buffer), bytes,
+                        offset + bytes == end);
+                offset += bytes;
+                if (!progress(bytes_done += bytes)) {
+                    failed = true;
+                    return;
+                }
+            }
+        }
+    };
+
+    num_threads = std::max(1u, std::min(num_threads, static_cast<unsigned>(num_stripes)));
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < num_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return !failed;
+}
+
+bool ComputeStripeDigest(uint64_t size, unsigned num_threads, const ImageReadFn& read,
+                         const ImageProgressFn& progress, std::string* digest) {
+    uint64_t num_stripes = (size + kDigestStripeSize - 1) / kDigestStripeSize;
+    std::vector<uint8_t> stripe_digests(num_stripes * SHA256_DIGEST_LENGTH);
+    std::vector<SHA256_CTX> contexts(num_stripes);
+    for (auto& ctx : contexts) {
+        SHA256_Init(&ctx);
+    }
+
+    auto consume = [&](uint64_t stripe, uint64_t, const char* data, size_t bytes,
+                       bool last) -> void {
+        SHA256_Update(&contexts[stripe], data, bytes);
+        if (last) {
+            SHA256_Final(&stripe_digests[stripe * SHA256_DIGEST_LENGTH], &contexts[stripe]);
+        }
+    };
+    if (!ReadStripes(size, num_threads, read, progress, consume)) {
+        return false;
+    }
+
+    uint8_t root[SHA256_DIGEST_LENGTH];
+    SHA256(stripe_digests.data(), stripe_digests.size(), root);
+    *digest = DigestToHex(root, sizeof(root));
+    return true;
+}
+
+template <typename T>
+static void Store(std::string* data, size_t offset, T value) {
+    memcpy(&(*data)[offset], &value, sizeof(value));
+}
+
+std::string BlockManifestHeader(uint64_t size) {
+    std::string header(kBlockManifestHeaderSize, '\0');
+    Store<uint32_t>(&header, 0, kBlockManifestMagic);
+    Store<uint16_t>(&header, 4, 1);
+    Store<uint16_t>(&header, 6, kBlockManifestHeaderSize);
+    Store<uint32_t>(&header, 8, kManifestBlockSize);
+    Store<uint32_t>(&header, 12, kManifestHashSize);
+    Store<uint64_t>(&header, 16, size);
+    Store<uint64_t>(&header, 24, (size + kManifestBlockSize - 1) / kManifestBlockSize);
+    return header;
+}
+
+bool ComputeBlockManifest(uint64_t size, unsigned num_threads, const ImageReadFn& read,
+                          const ImageProgressFn& progress, std::string* manifest) {
+    uint64_t num_blocks = (size + kManifestBlockSize - 1) / kManifestBlockSize;
+    std::string data = BlockManifestHeader(size);
+    data.resize(kBlockManifestHeaderSize + num_blocks * kManifestHashSize);
+
+    // Reads are block aligned, except at the end of the image.
+    auto consume = [&](uint64_t, uint64_t offset, const char* buffer, size_t bytes,
+                       bool) -> void {
+        for (size_t pos = 0; pos < bytes; pos += kManifestBlockSize) {
+            uint8_t digest[SHA256_DIGEST_LENGTH];
+            size_t length = std::min(bytes - pos, static_cast<size_t>(kManifestBlockSize));
+            SHA256(reinterpret_cast<const uint8_t*>(buffer + pos), length, digest);
+
+            uint64_t block = (offset + pos) / kManifestBlockSize;
+            memcpy(&data[kBlockManifestHeaderSize + block * kManifestHashSize], digest,
+                   kManifestHashSize);
+        }
+    };
+    if (!ReadStripes(size, num_threads, read, progress, consume)) {
+        return false;
+    }
+    *manifest = std::move(data);
+    return true;
+}
+
+ImageHasher::ImageHasher(bool full_digest) : full_digest_(full_digest) {
+    SHA256_Init(&full_ctx_);
+    SHA256_Init(&stripe_ctx_);
+    SHA256_Init(&root_ctx_);
+    SHA256_Init(&block_ctx_);
+    thread_ = std::thread([this]() -> void { Worker(); });
+}
+
+ImageHasher::~ImageHasher() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        done_ = true;
+        cv_.notify_all();
+    }
+    thread_.join();
+}
+
+void ImageHasher::Update(const void* data, size_t bytes) {
+    if (!bytes) {
+        return;
+    }
+    auto begin = reinterpret_cast<const char*>(data);
+    Work work;
+    work.data.assign(begin, begin + bytes);
+    Enqueue(std::move(work));
+}
+
+void ImageHasher::UpdateZeroes(uint64_t bytes) {
+    if (!bytes) {
+        return;
+    }
+    Work work;
+    work.zeroes = bytes;
+    Enqueue(std::move(work));
+}
+
+void ImageHasher::Enqueue(Work&& work) {
+    std::unique_lock<std::mutex> lock(lock_);
+    cv_.wait(lock, [this] { return queued_bytes_ < kMaxQueuedBytes; });
+    queued_bytes_ += work.data.size();
+    queue_.emplace_back(std::move(work));
+    cv_.notify_all();
+}
+
+void ImageHasher::Worker() {
+    static const std::vector<char> kZeroes(kZeroBufferSize);
+
+    std::unique_lock<std::mutex> lock(lock_);
+    while (true) {
+        cv_.wait(lock, [this] { return done_ || !queue_.empty(); });
+        if (queue_.empty()) {
+            return;
+        }
+        Work work = std::move(queue_.front());
+        queue_.pop_front();
+        busy_ = true;
+        lock.unlock();
+
+        Hash(work.data.data(), work.data.size());
+        for (uint64_t left = work.zeroes; left;) {
+            size_t bytes = std::min(left, static_cast<uint64_t>(kZeroes.size()));
+            Hash(kZeroes.data(), bytes);
+            left -= bytes;
+        }
+
+        lock.lock();
+        busy_ = false;
+        queued_bytes_ -= work.data.size();
+        cv_.notify_all();
+    }
+}
+
+void ImageHasher::Hash(const char* data, size_t bytes) {
+    if (full_digest_) {
+        SHA256_Update(&full_ctx_, data, bytes);
+    }
+    total_bytes_ += bytes;
+    while (bytes) {
+        // Stripes are a whole number of blocks, so stopping at the end of
+        // each block also stops at the end of each stripe.
+        size_t to_hash = std::min(static_cast<uint64_t>(bytes), kManifestBlockSize - block_bytes_);
+        SHA256_Update(&stripe_ctx_, data, to_hash);
+        SHA256_Update(&block_ctx_, data, to_hash);
+        stripe_bytes_ += to_hash;
+        block_bytes_ += to_hash;
+        data += to_hash;
+        bytes -= to_hash;
+
+        if (block_bytes_ == kManifestBlockSize) {
+            FinishBlock();
+        }
+        if (stripe_bytes_ == kDigestStripeSize) {
+            uint8_t digest[SHA256_DIGEST_LENGTH];
+            SHA256_Final(digest, &stripe_ctx_);
+            SHA256_Update(&root_ctx_, digest, sizeof(digest));
+            SHA256_Init(&stripe_ctx_);
+            stripe_bytes_ = 0;
+        }
+    }
+}
+
+void ImageHasher::FinishBlock() {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256_Final(digest, &block_ctx_);
+    block_hashes_.append(reinterpret_cast<const char*>(digest), kManifestHashSize);
+    SHA256_Init(&block_ctx_);
+    block_bytes_ = 0;
+}
+
+void ImageHasher::Finish(std::string* full_digest, std::string* stripe_digest,
+                         std::string* block_manifest) {
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        cv_.wait(lock, [this] { return queue_.empty() && !busy_; });
+    }
+
+    if (block_bytes_) {
+        FinishBlock();
+    }
+    *block_manifest = BlockManifestHeader(total_bytes_) + block_hashes_;
+    block_hashes_.clear();
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    if (stripe_bytes_) {
+        SHA256_Final(digest, &stripe_ctx_);
+        SHA256_Update(&root_ctx_, digest, sizeof(digest));
+        SHA256_Init(&stripe_ctx_);
+        stripe_bytes_ = 0;
+    }
+    SHA256_Final(digest, &root_ctx_);
+    *stripe_digest = DigestToHex(digest, sizeof(digest));
+
+    full_digest->clear();
+    if (full_digest_) {
+        SHA256_Final(digest, &full_ctx_);
+        *full_digest = DigestToHex(digest, sizeof(digest));
+    }
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/sha.h>
+
+namespace android {
+namespace gsi {
+
+// The stripe digest of an image is the SHA-256 of the concatenated SHA-256
+// digests of each kDigestStripeSize stripe of the image (the last stripe may
+// be shorter). Unlike a plain SHA-256, it can be computed in parallel.
+static constexpr uint64_t kDigestStripeSize = 64 * 1024 * 1024;
+
+// Lowercase hex encoding of a digest.
+std::string DigestToHex(const uint8_t* digest, size_t size);
+
+// Reads |bytes| of the image at |offset| into |data|. It is called from
+// several threads at once.
+using ImageReadFn = std::function<bool(void* data, size_t bytes, uint64_t offset)>;
+// Called with the number of bytes hashed so far. Returning false stops
+// early.
+using ImageProgressFn = std::function<bool(uint64_t bytes)>;
+
+// Compute the stripe digest of an image of |size| bytes, reading and
+// hashing stripes on |num_threads| threads.
+bool ComputeStripeDigest(uint64_t size, unsigned num_threads, const ImageReadFn& read,
+                         const ImageProgressFn& progress, std::string* digest);
+
+// A block manifest lists a hash for each block of an image, so that a client
+// can send only the blocks that differ from an installed image, as a delta
+// (see delta_decoder.h). All integers are little-endian.
+//   0  u32  magic, kBlockManifestMagic
+//   4  u16  major version, 1
+//   6  u16  header size
+//   8  u32  block size
+//   12 u32  hash size
+//   16 u64  image size
+//   24 u64  number of blocks
+// The header is followed by a fixed-size record for each block: the first
+// bytes of its SHA-256. The last block may be short, and is hashed as it is.
+// The records are aligned, so the file can be used with mmap().
+static constexpr uint32_t kBlockManifestMagic = 0x464d4247;  // "GBMF"
+static constexpr uint16_t kBlockManifestHeaderSize = 32;
+static constexpr uint32_t kManifestBlockSize = 4096;
+static constexpr uint32_t kManifestHashSize = 16;
+
+// Compute the block manifest of an image of |size| bytes, on |num_threads|
+// threads.
+bool ComputeBlockManifest(uint64_t size, unsigned num_threads, const ImageReadFn& read,
+                          const ImageProgressFn& progress, std::string* manifest);
+
+// The header of the block manifest of an image of |size| bytes.
+std::string BlockManifestHeader(uint64_t size);
+
+// Hashes image data on a background thread, as it is written. The stripe
+// digest and block manifest are always computed; the SHA-256 of the whole
+// image only if asked.
+class ImageHasher {
+  public:
+    explicit ImageHasher(bool full_digest);
+    ~ImageHasher();
+
+    // Queue data to be hashed. This only blocks if the hashing thread has
+    // fallen far behind.
+    void Update(const void* data, size_t bytes);
+    void UpdateZeroes(uint64_t bytes);
+
+    // Wait for all queued data to be hashed, and return the digests in hex
+    // along with the block manifest. |full_digest| is left empty if it was
+    // not computed. This may only be called once.
+    void Finish(std::string* full_digest, std::string* stripe_digest,
+                std::string* block_manifest);
+
+    ImageHasher(const ImageHasher&) = delete;
+    ImageHasher& operator=(const ImageHasher&) = delete;
+
+  private:
+    // Either a copy of some data, or a run of zeroes.
+    struct Work {
+        std::vector<char> data;
+        uint64_t zeroes = 0;
+    };
+
+    void Enqueue(Work&& work);
+    void Worker();
+    void Hash(const char* data, size_t bytes);
+    void FinishBlock();
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::deque<Work> queue_;
+    size_t queued_bytes_ = 0;
+    bool busy_ = false;
+    bool done_ = false;
+
+    // Only touched by the worker thread until Finish().
+    bool full_digest_;
+    SHA256_CTX full_ctx_;
+    SHA256_CTX stripe_ctx_;
+    SHA256_CTX root_ctx_;
+    SHA256_CTX block_ctx_;
+    uint64_t stripe_bytes_ = 0;
+    uint64_t block_bytes_ = 0;
+    uint64_t total_bytes_ = 0;
+    // The block manifest records, without the header.
+    std::string block_hashes_;
+
+    std::thread thread_;
+};
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install_report.h"
+
+namespace android {
+namespace gsi {
+
+void InstallReport::Reset() {
+    std::lock_guard<std::mutex> guard(lock_);
+    phases_.clear();
+    system_extents_ = 0;
+    userdata_extents_ = 0;
+    read_calls_ = 0;
+    write_calls_ = 0;
+    bytes_written_ = 0;
+    bytes_skipped_ = 0;
+    bytes_zeroed_ = 0;
+    for (auto& count : write_latency_) {
+        count = 0;
+    }
+}
+
+void InstallReport::AddPhase(const std::string& name, Clock::duration duration) {
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+
+    std::lock_guard<std::mutex> guard(lock_);
+    for (auto& phase : phases_) {
+        if (phase.name == name) {
+            phase.count++;
+            phase.durationUs += us;
+            return;
+        }
+    }
+    GsiInstallPhase phase;
+    phase.name = name;
+    phase.count = 1;
+    phase.durationUs = us;
+    phases_.emplace_back(std::move(phase));
+}
+
+void InstallReport::AddWrite(uint64_t bytes, Clock::duration latency) {
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    size_t bucket = 0;
+    for (int64_t bound = kFirstLatencyBoundUs; us >= bound && bucket + 1 < kLatencyBuckets;
+         bound *= 2) {
+        bucket++;
+    }
+    write_latency_[bucket]++;
+    bytes_written_ += bytes;
+}
+
+void InstallReport::SetExtents(const std::string& partition, uint64_t extents) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (partition == "system_gsi") {
+        system_extents_ = extents;
+    } else if (partition == "userdata_gsi") {
+        userdata_extents_ = extents;
+    }
+}
+
+GsiInstallReport InstallReport::Get() {
+    GsiInstallReport report;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        report.phases = phases_;
+        report.systemExtents = system_extents_;
+        report.userdataExtents = userdata_extents_;
+    }
+    for (size_t i = 0; i < kLatencyBuckets; i++) {
+        report.writeLatencyBoundsUs.emplace_back(kFirstLatencyBoundUs << i);
+        report.writeLatencyCounts.emplace_back(write_latency_[i]);
+    }
+    report.readCalls = read_calls_;
+    report.writeCalls = write_calls_;
+    report.bytesWritten = bytes_written_;
+    report.bytesSkipped = bytes_skipped_;
+    report.bytesZeroed = bytes_zeroed_;
+    return report;
+}
+
+}  // namespace gsi
+}  // namespace android
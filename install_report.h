@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android/gsi/GsiInstallReport.h>
+
+namespace android {
+namespace gsi {
+
+// Performance counters for one install, as returned by getLastInstallReport().
+// Counters may be updated from any thread.
+class InstallReport {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // Start a new report.
+    void Reset();
+
+    // Add |duration| to the phase called |name|, creating it if needed.
+    void AddPhase(const std::string& name, Clock::duration duration);
+    // Count a syscall that reads from the client's stream.
+    void AddRead() { read_calls_++; }
+    // Count a syscall that sends data to the system image, such as write(),
+    // pwrite(), splice() or io_uring_submit().
+    void AddWriteCall() { write_calls_++; }
+    // Record a write of |bytes| that reached the system image |latency|
+    // after it was issued.
+    void AddWrite(uint64_t bytes, Clock::duration latency);
+    void AddSkipped(uint64_t bytes) { bytes_skipped_ += bytes; }
+    void AddZeroed(uint64_t bytes) { bytes_zeroed_ += bytes; }
+    void SetExtents(const std::string& partition, uint64_t extents);
+
+    GsiInstallReport Get();
+
+    // Adds the time from its creation to its destruction as a phase.
+    class Phase {
+      public:
+        Phase(InstallReport* report, const std::string& name)
+            : report_(report), name_(name), start_(Clock::now()) {}
+        ~Phase() { report_->AddPhase(name_, Clock::now() - start_); }
+
+      private:
+        InstallReport* report_;
+        std::string name_;
+        Clock::time_point start_;
+    };
+
+  private:
+    // Write latency bucket bounds double from kFirstLatencyBoundUs.
+    static constexpr size_t kLatencyBuckets = 20;
+    static constexpr int64_t kFirstLatencyBoundUs = 16;
+
+    std::mutex lock_;
+    std::vector<GsiInstallPhase> phases_;
+    int32_t system_extents_ = 0;
+    int32_t userdata_extents_ = 0;
+
+    std::atomic<int64_t> read_calls_ = 0;
+    std::atomic<int64_t> write_calls_ = 0;
+    std::atomic<int64_t> bytes_written_ = 0;
+    std::atomic<int64_t> bytes_skipped_ = 0;
+    std::atomic<int64_t> bytes_zeroed_ = 0;
+    std::array<std::atomic<int64_t>, kLatencyBuckets> write_latency_ = {};
+};
+
+}  // namespace gsi
+}  // namespace android
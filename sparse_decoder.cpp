@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sparse_decoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+namespace android {
+namespace gsi {
+
+// These match libsparse's sparse_format.h.
+static constexpr uint32_t kSparseMagic = 0xed26ff3a;
+static constexpr uint16_t kSparseMajorVersion = 1;
+static constexpr size_t kChunkHeaderSize = 12;
+static constexpr uint16_t kChunkTypeRaw = 0xcac1;
+static constexpr uint16_t kChunkTypeFill = 0xcac2;
+static constexpr uint16_t kChunkTypeDontCare = 0xcac3;
+static constexpr uint16_t kChunkTypeCrc32 = 0xcac4;
+
+template <typename T>
+static T Load(const uint8_t* data, size_t offset) {
+    T value;
+    memcpy(&value, data + offset, sizeof(value));
+    return value;
+}
+
+SparseDecoder::SparseDecoder(WriteFn&& write, FillFn&& fill, SkipFn&& skip)
+    : write_(std::move(write)), fill_(std::move(fill)), skip_(std::move(skip)) {}
+
+bool SparseDecoder::IsSparse(const void* data, size_t bytes, uint64_t* image_size) {
+    if (bytes < kSparseHeaderSize) {
+        return false;
+    }
+    auto header = reinterpret_cast<const uint8_t*>(data);
+    if (Load<uint32_t>(header, 0) != kSparseMagic) {
+        return false;
+    }
+    if (image_size) {
+        *image_size = uint64_t(Load<uint32_t>(header, 12)) * Load<uint32_t>(header, 16);
+    }
+    return true;
+}
+
+size_t SparseDecoder::Buffer(const uint8_t* data, size_t bytes, size_t size) {
+    size_t to_copy = std::min(bytes, size - header_.size());
+    header_.insert(header_.end(), data, data + to_copy);
+    return to_copy;
+}
+
+bool SparseDecoder::Decode(const void* data, size_t bytes) {
+    auto pos = reinterpret_cast<const uint8_t*>(data);
+    while (bytes) {
+        size_t consumed = 0;
+        switch (state_) {
+            case State::kFileHeader:
+                consumed = Buffer(pos, bytes, kSparseHeaderSize);
+                if (header_.size() == kSparseHeaderSize && !ParseFileHeader()) {
+                    return false;
+                }
+                break;
+            case State::kSkipHeader:
+                consumed = std::min(static_cast<uint64_t>(bytes), remaining_);
+                remaining_ -= consumed;
+                if (!remaining_) {
+                    state_ = total_chunks_ ? State::kChunkHeader : State::kDone;
+                }
+                break;
+            case State::kChunkHeader:
+                consumed = Buffer(pos, bytes, chunk_header_size_);
+                if (header_.size() == chunk_header_size_ && !ParseChunkHeader()) {
+                    return false;
+                }
+                break;
+            case State::kChunkRaw:
+                consumed = std::min(static_cast<uint64_t>(bytes), remaining_);
+                if (!write_(pos, consumed)) {
+                    return false;
+                }
+                remaining_ -= consumed;
+                if (!remaining_ && !FinishChunk()) {
+                    return false;
+                }
+                break;
+            case State::kChunkFill:
+                consumed = Buffer(pos, bytes, sizeof(uint32_t));
+                if (header_.size() == sizeof(uint32_t)) {
+                    if (!fill_(Load<uint32_t>(header_.data(), 0), chunk_bytes_) ||
+                        !FinishChunk()) {
+                        return false;
+                    }
+                }
+                break;
+            case State::kChunkCrc:
+                // The image checksum is optional; fastboot doesn't check it
+                // either.
+                consumed = Buffer(pos, bytes, sizeof(uint32_t));
+                if (header_.size() == sizeof(uint32_t) && !FinishChunk()) {
+                    return false;
+                }
+                break;
+            case State::kDone:
+                LOG(ERROR) << "unexpected data after the end of the sparse image";
+                return false;
+        }
+        pos += consumed;
+        bytes -= consumed;
+    }
+    return true;
+}
+
+bool SparseDecoder::ParseFileHeader() {
+    const uint8_t* header = header_.data();
+    if (Load<uint32_t>(header, 0) != kSparseMagic) {
+        LOG(ERROR) << "bad sparse image magic";
+        return false;
+    }
+    uint16_t major_version = Load<uint16_t>(header, 4);
+    uint16_t file_header_size = Load<uint16_t>(header, 8);
+    chunk_header_size_ = Load<uint16_t>(header, 10);
+    block_size_ = Load<uint32_t>(header, 12);
+    uint32_t total_blocks = Load<uint32_t>(header, 16);
+    total_chunks_ = Load<uint32_t>(header, 20);
+
+    if (major_version != kSparseMajorVersion) {
+        LOG(ERROR) << "unsupported sparse image version " << major_version;
+        return false;
+    }
+    if (file_header_size < kSparseHeaderSize || chunk_header_size_ < kChunkHeaderSize) {
+        LOG(ERROR) << "bad sparse image header sizes: " << file_header_size << ", "
+                   << chunk_header_size_;
+        return false;
+    }
+    if (!block_size_ || block_size_ % 4) {
+        LOG(ERROR) << "bad sparse image block size: " << block_size_;
+        return false;
+    }
+    image_size_ = uint64_t(block_size_) * total_blocks;
+    // With no chunks, nothing would be left to catch an image that is never
+    // written.
+    if (!total_chunks_ && image_size_) {
+        LOG(ERROR) << "sparse image has no chunks, but is " << image_size_ << " bytes";
+        return false;
+    }
+
+    header_.clear();
+    remaining_ = file_header_size - kSparseHeaderSize;
+    if (remaining_) {
+        state_ = State::kSkipHeader;
+    } else if (total_chunks_) {
+        state_ = State::kChunkHeader;
+    } else {
+        state_ = State::kDone;
+    }
+    return true;
+}
+
+bool SparseDecoder::ParseChunkHeader() {
+    const uint8_t* header = header_.data();
+    uint16_t type = Load<uint16_t>(header, 0);
+    uint32_t chunk_blocks = Load<uint32_t>(header, 4);
+    uint32_t total_size = Load<uint32_t>(header, 8);
+    header_.clear();
+
+    if (total_size < chunk_header_size_) {
+        LOG(ERROR) << "sparse chunk " << chunks_done_ << " is too small: " << total_size;
+        return false;
+    }
+    uint64_t body_size = total_size - chunk_header_size_;
+    chunk_bytes_ = uint64_t(chunk_blocks) * block_size_;
+    if (chunk_bytes_ > image_size_ - bytes_decoded_) {
+        LOG(ERROR) << "sparse chunk " << chunks_done_ << " extends past the end of the image";
+        return false;
+    }
+
+    uint64_t expected_body_size;
+    switch (type) {
+        case kChunkTypeRaw:
+            expected_body_size = chunk_bytes_;
+            state_ = State::kChunkRaw;
+            remaining_ = chunk_bytes_;
+            break;
+        case kChunkTypeFill:
+            expected_body_size = sizeof(uint32_t);
+            state_ = State::kChunkFill;
+            break;
+        case kChunkTypeDontCare:
+            expected_body_size = 0;
+            break;
+        case kChunkTypeCrc32:
+            expected_body_size = sizeof(uint32_t);
+            state_ = State::kChunkCrc;
+            break;
+        default:
+            LOG(ERROR) << "unknown sparse chunk type " << std::hex << type;
+            return false;
+    }
+    if (body_size != expected_body_size) {
+        LOG(ERROR) << "sparse chunk " << chunks_done_ << " has size " << body_size
+                   << ", expected " << expected_body_size;
+        return false;
+    }
+
+    if (type == kChunkTypeDontCare) {
+        return skip_(chunk_bytes_) && FinishChunk();
+    }
+    // An empty raw chunk has no body to wait for.
+    if (type == kChunkTypeRaw && !remaining_) {
+        return FinishChunk();
+    }
+    return true;
+}
+
+bool SparseDecoder::FinishChunk() {
+    header_.clear();
+    bytes_decoded_ += chunk_bytes_;
+    chunk_bytes_ = 0;
+
+    if (++chunks_done_ < total_chunks_) {
+        state_ = State::kChunkHeader;
+        return true;
+    }
+    if (bytes_decoded_ != image_size_) {
+        LOG(ERROR) << "sparse image ended after " << bytes_decoded_ << " of " << image_size_
+                   << " bytes";
+        return false;
+    }
+    state_ = State::kDone;
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android
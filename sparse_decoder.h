@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+namespace android {
+namespace gsi {
+
+// Size of the header at the start of every Android sparse image.
+static constexpr size_t kSparseHeaderSize = 28;
+
+// Decode an Android sparse image as it arrives, in chunks of any size. The
+// decoded image is passed to the callbacks in order, from offset 0.
+class SparseDecoder {
+  public:
+    // Write |bytes| of image data.
+    using WriteFn = std::function<bool(const void* data, uint64_t bytes)>;
+    // Write |bytes| of image data repeating a 32-bit pattern.
+    using FillFn = std::function<bool(uint32_t value, uint64_t bytes)>;
+    // Advance past |bytes| of the image whose contents do not matter.
+    using SkipFn = std::function<bool(uint64_t bytes)>;
+
+    SparseDecoder(WriteFn&& write, FillFn&& fill, SkipFn&& skip);
+
+    // Returns true if |data| starts with a sparse image header. If
+    // |image_size| is not null, it is set to the size of the decoded image.
+    static bool IsSparse(const void* data, size_t bytes, uint64_t* image_size = nullptr);
+
+    bool Decode(const void* data, size_t bytes);
+
+    // True once every chunk described by the header has been decoded.
+    bool finished() const { return state_ == State::kDone; }
+    uint64_t image_size() const { return image_size_; }
+
+  private:
+    enum class State {
+        kFileHeader,
+        kChunkHeader,
+        kChunkRaw,
+        kChunkFill,
+        kChunkCrc,
+        kSkipHeader,
+        kDone,
+    };
+
+    bool ParseFileHeader();
+    bool ParseChunkHeader();
+    bool FinishChunk();
+    // Accumulate up to |size| bytes into header_, returning the number of
+    // bytes consumed from |data|.
+    size_t Buffer(const uint8_t* data, size_t bytes, size_t size);
+
+    WriteFn write_;
+    FillFn fill_;
+    SkipFn skip_;
+
+    State state_ = State::kFileHeader;
+    std::vector<uint8_t> header_;
+    // Bytes of the current header or chunk body still to be consumed.
+    uint64_t remaining_ = 0;
+    uint32_t block_size_ = 0;
+    uint32_t chunk_header_size_ = 0;
+    uint32_t total_chunks_ = 0;
+    uint32_t chunks_done_ = 0;
+    // Image bytes covered by the current chunk.
+    uint64_t chunk_bytes_ = 0;
+    uint64_t image_size_ = 0;
+    uint64_t bytes_decoded_ = 0;
+};
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,190 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <string.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "delta_decoder.h"
+#include "test_util.h"
+
+using namespace android::gsi;
+
+static constexpr uint32_t kBlockSize = 4096;
+
+static std::string MakeHeader(uint32_t block_size, uint32_t total_ops, uint64_t image_size) {
+    std::string header;
+    Append<uint32_t>(&header, kDeltaMagic);
+    Append<uint16_t>(&header, 1);
+    Append<uint16_t>(&header, kDeltaHeaderSize);
+    Append<uint32_t>(&header, block_size);
+    Append<uint32_t>(&header, total_ops);
+    Append<uint64_t>(&header, image_size);
+    header.append(64, '\0');
+    return header;
+}
+
+static std::string MakeOp(uint16_t type, uint32_t count, uint64_t dest, uint64_t source) {
+    std::string op;
+    Append<uint16_t>(&op, type);
+    Append<uint16_t>(&op, 0);
+    Append<uint32_t>(&op, count);
+    Append<uint64_t>(&op, dest);
+    Append<uint64_t>(&op, source);
+    return op;
+}
+
+// Applies deltas to an in-memory image.
+class DeltaDecoderTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        image_.resize(8 * kBlockSize);
+        for (size_t i = 0; i < image_.size(); i++) {
+            image_[i] = static_cast<char>(i / kBlockSize + 1);
+        }
+    }
+
+    DeltaDecoder MakeDecoder() {
+        auto write = [this](uint64_t offset, const void* data, uint64_t bytes) -> bool {
+            memcpy(&image_[offset], data, bytes);
+            return true;
+        };
+        auto zero = [this](uint64_t offset, uint64_t bytes) -> bool {
+            memset(&image_[offset], 0, bytes);
+            return true;
+        };
+        auto copy = [this](uint64_t source, uint64_t dest, uint64_t bytes) -> bool {
+            memmove(&image_[dest], &image_[source], bytes);
+            return true;
+        };
+        return DeltaDecoder(std::move(write), std::move(zero), std::move(copy));
+    }
+
+    bool Apply(const std::string& delta, size_t chunk, bool* finished) {
+        auto decoder = MakeDecoder();
+        auto decode = [&decoder](const char* data, size_t bytes) -> bool {
+            return decoder.Decode(data, bytes);
+        };
+        if (!FeedInPieces(delta, chunk, decode)) {
+            return false;
+        }
+        *finished = decoder.finished();
+        return true;
+    }
+
+    char Block(size_t block) const { return image_[block * kBlockSize]; }
+
+    std::string image_;
+};
+
+TEST(DeltaHeader, Valid) {
+    auto data = MakeHeader(kBlockSize, 3, 8 * kBlockSize);
+    DeltaHeader header;
+    ASSERT_TRUE(DeltaDecoder::ParseHeader(data.data(), data.size(), &header));
+    EXPECT_EQ(header.block_size, kBlockSize);
+    EXPECT_EQ(header.total_ops, 3u);
+    EXPECT_EQ(header.image_size, 8u * kBlockSize);
+    EXPECT_TRUE(header.source_digest.empty());
+    EXPECT_TRUE(header.target_digest.empty());
+}
+
+TEST(DeltaHeader, BadMagic) {
+    auto data = MakeHeader(kBlockSize, 0, kBlockSize);
+    data[0] ^= 1;
+    DeltaHeader header;
+    EXPECT_FALSE(DeltaDecoder::ParseHeader(data.data(), data.size(), &header));
+}
+
+TEST(DeltaHeader, TooShort) {
+    auto data = MakeHeader(kBlockSize, 0, kBlockSize);
+    DeltaHeader header;
+    EXPECT_FALSE(DeltaDecoder::ParseHeader(data.data(), data.size() - 1, &header));
+}
+
+TEST(DeltaHeader, BadBlockSize) {
+    DeltaHeader header;
+    for (uint32_t block_size : {0u, 1u, 512u, 6000u, 32u * 1024 * 1024}) {
+        auto data = MakeHeader(block_size, 0, 64ULL * 1024 * 1024);
+        EXPECT_FALSE(DeltaDecoder::ParseHeader(data.data(), data.size(), &header)) << block_size;
+    }
+}
+
+TEST(DeltaHeader, UnalignedImageSize) {
+    auto data = MakeHeader(kBlockSize, 0, kBlockSize + 512);
+    DeltaHeader header;
+    EXPECT_FALSE(DeltaDecoder::ParseHeader(data.data(), data.size(), &header));
+}
+
+TEST_F(DeltaDecoderTest, AppliesOps) {
+    std::string delta = MakeHeader(kBlockSize, 3, image_.size());
+    // Copy block 5 to block 0 first, since later ops overwrite block 5.
+    delta += MakeOp(3, 1, 0, 5);
+    delta += MakeOp(1, 2, 4, 0);
+    delta += std::string(kBlockSize, 'a') + std::string(kBlockSize, 'b');
+    delta += MakeOp(2, 1, 7, 0);
+
+    for (size_t chunk : {static_cast<size_t>(1), static_cast<size_t>(7), delta.size()}) {
+        SetUp();
+        bool finished = false;
+        ASSERT_TRUE(Apply(delta, chunk, &finished)) << chunk;
+        EXPECT_TRUE(finished);
+        EXPECT_EQ(Block(0), 6);
+        EXPECT_EQ(Block(1), 2);
+        EXPECT_EQ(Block(4), 'a');
+        EXPECT_EQ(Block(5), 'b');
+        EXPECT_EQ(Block(7), 0);
+    }
+}
+
+TEST_F(DeltaDecoderTest, Truncated) {
+    std::string delta = MakeHeader(kBlockSize, 1, image_.size());
+    delta += MakeOp(1, 1, 0, 0);
+    delta += std::string(kBlockSize - 1, 'a');
+    bool finished = true;
+    ASSERT_TRUE(Apply(delta, 100, &finished));
+    EXPECT_FALSE(finished);
+}
+
+TEST_F(DeltaDecoderTest, WritePastEnd) {
+    std::string delta = MakeHeader(kBlockSize, 1, image_.size());
+    delta += MakeOp(2, 2, 7, 0);
+    bool finished;
+    EXPECT_FALSE(Apply(delta, delta.size(), &finished));
+}
+
+TEST_F(DeltaDecoderTest, CopyOfOverwrittenBlock) {
+    std::string delta = MakeHeader(kBlockSize, 2, image_.size());
+    delta += MakeOp(2, 1, 3, 0);
+    delta += MakeOp(3, 1, 0, 3);
+    bool finished;
+    EXPECT_FALSE(Apply(delta, delta.size(), &finished));
+}
+
+TEST_F(DeltaDecoderTest, OverlappingCopy) {
+    std::string delta = MakeHeader(kBlockSize, 1, image_.size());
+    delta += MakeOp(3, 2, 1, 0);
+    bool finished;
+    EXPECT_FALSE(Apply(delta, delta.size(), &finished));
+}
+
+TEST_F(DeltaDecoderTest, DataAfterEnd) {
+    std::string delta = MakeHeader(kBlockSize, 0, image_.size());
+    delta += "x";
+    bool finished;
+    EXPECT_FALSE(Apply(delta, delta.size(), &finished));
+}
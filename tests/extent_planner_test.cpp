@@ -0,0 +1,86 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <numeric>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "extent_planner.h"
+
+using namespace android::gsi;
+
+static constexpr uint64_t kBlockSize = 4096;
+static constexpr uint64_t kMiB = 1024 * 1024;
+static constexpr uint64_t kNoLimit = UINT64_MAX;
+
+static uint64_t Sum(const std::vector<uint64_t>& pieces) {
+    return std::accumulate(pieces.begin(), pieces.end(), static_cast<uint64_t>(0));
+}
+
+TEST(PlanImagePieces, NoRuns) {
+    auto pieces = PlanImagePieces({}, 100 * kMiB, kBlockSize, kNoLimit);
+    EXPECT_EQ(pieces, std::vector<uint64_t>({100 * kMiB}));
+}
+
+TEST(PlanImagePieces, LargestRunsFirst) {
+    auto pieces = PlanImagePieces({300 * kMiB, 200 * kMiB, 100 * kMiB}, 450 * kMiB, kBlockSize,
+                                  kNoLimit);
+    EXPECT_EQ(pieces, std::vector<uint64_t>({300 * kMiB, 150 * kMiB}));
+}
+
+TEST(PlanImagePieces, SmallRunsAreNotUsed) {
+    auto pieces = PlanImagePieces({200 * kMiB, 10 * kMiB, 10 * kMiB}, 250 * kMiB, kBlockSize,
+                                  kNoLimit);
+    EXPECT_EQ(pieces, std::vector<uint64_t>({200 * kMiB, 50 * kMiB}));
+}
+
+TEST(PlanImagePieces, SmallLastPiece) {
+    // The last piece covers what is left, however small.
+    auto pieces = PlanImagePieces({200 * kMiB, 10 * kMiB}, 201 * kMiB, kBlockSize, kNoLimit);
+    EXPECT_EQ(pieces, std::vector<uint64_t>({200 * kMiB, 1 * kMiB}));
+}
+
+TEST(PlanImagePieces, BlockAligned) {
+    auto pieces = PlanImagePieces({100 * kMiB + 1000}, 200 * kMiB, kBlockSize, kNoLimit);
+    EXPECT_EQ(pieces, std::vector<uint64_t>({100 * kMiB, 100 * kMiB}));
+}
+
+TEST(PlanImagePieces, UnalignedSize) {
+    uint64_t size = 150 * kMiB + 512;
+    auto pieces = PlanImagePieces({100 * kMiB, 100 * kMiB}, size, kBlockSize, kNoLimit);
+    ASSERT_EQ(pieces.size(), 2u);
+    EXPECT_EQ(pieces[0], 100 * kMiB);
+    EXPECT_EQ(Sum(pieces), size);
+}
+
+TEST(PlanImagePieces, MaxPieceSize) {
+    auto pieces = PlanImagePieces({}, 2500 * kMiB, kBlockSize, 1024 * kMiB);
+    EXPECT_EQ(pieces, std::vector<uint64_t>({1024 * kMiB, 1024 * kMiB, 452 * kMiB}));
+
+    pieces = PlanImagePieces({3000 * kMiB}, 2500 * kMiB, kBlockSize, 1024 * kMiB);
+    EXPECT_EQ(pieces, std::vector<uint64_t>({1024 * kMiB, 1024 * kMiB, 452 * kMiB}));
+}
+
+TEST(PlanImagePieces, PieceCountIsBounded) {
+    std::vector<uint64_t> runs(100, 64 * kMiB);
+    uint64_t size = 100 * 64 * kMiB;
+    auto pieces = PlanImagePieces(runs, size, kBlockSize, kNoLimit);
+    ASSERT_EQ(pieces.size(), 64u);
+    EXPECT_EQ(pieces.front(), 64 * kMiB);
+    EXPECT_EQ(pieces.back(), 37 * 64 * kMiB);
+    EXPECT_EQ(Sum(pieces), size);
+}
@@ -0,0 +1,123 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <string.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "image_digest.h"
+#include "test_util.h"
+
+using namespace android::gsi;
+
+static constexpr unsigned kThreads = 4;
+
+// An image of |size| pseudo-random bytes, with a run of zeroes over
+// [zero_start, zero_end).
+static std::string MakeImage(uint64_t size, uint64_t zero_start, uint64_t zero_end) {
+    std::string image(size, '\0');
+    uint32_t state = 1;
+    for (uint64_t i = 0; i < size; i++) {
+        state = state * 1103515245 + 12345;
+        if (i < zero_start || i >= zero_end) {
+            image[i] = static_cast<char>(state >> 16);
+        }
+    }
+    return image;
+}
+
+// The digests computed while an image is written must match the ones
+// computed later by reading it back, or verification of an untouched
+// install would fail.
+class ImageDigestTest : public ::testing::TestWithParam<uint64_t> {
+  protected:
+    // Hash |image| as it would be written during an install: in pieces of
+    // |piece_size| bytes, with [zero_start, zero_end) passed as zeroes.
+    void HashWhileWriting(const std::string& image, size_t piece_size, uint64_t zero_start,
+                          uint64_t zero_end) {
+        ImageHasher hasher(true);
+        auto update = [&hasher](const char* data, size_t bytes) -> bool {
+            hasher.Update(data, bytes);
+            return true;
+        };
+        FeedInPieces(image.substr(0, zero_start), piece_size, update);
+        hasher.UpdateZeroes(zero_end - zero_start);
+        FeedInPieces(image.substr(zero_end), piece_size, update);
+        hasher.Finish(&full_digest_, &stripe_digest_, &manifest_);
+    }
+
+    std::string full_digest_;
+    std::string stripe_digest_;
+    std::string manifest_;
+};
+
+TEST_P(ImageDigestTest, MatchesReadBack) {
+    uint64_t size = GetParam();
+    uint64_t zero_start = size / 3;
+    uint64_t zero_end = zero_start + size / 4;
+    std::string image = MakeImage(size, zero_start, zero_end);
+
+    auto read = [&image](void* data, size_t bytes, uint64_t offset) -> bool {
+        if (offset + bytes > image.size()) {
+            return false;
+        }
+        memcpy(data, image.data() + offset, bytes);
+        return true;
+    };
+    auto progress = [](uint64_t) -> bool { return true; };
+    std::string stripe_digest, manifest;
+    ASSERT_TRUE(ComputeStripeDigest(size, kThreads, read, progress, &stripe_digest));
+    ASSERT_TRUE(ComputeBlockManifest(size, kThreads, read, progress, &manifest));
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(image.data()), image.size(), digest);
+    std::string full_digest = DigestToHex(digest, sizeof(digest));
+
+    // Pieces that don't line up with blocks or stripes.
+    for (size_t piece_size : {static_cast<size_t>(4093), static_cast<size_t>(1024 * 1024 + 13)}) {
+        HashWhileWriting(image, piece_size, zero_start, zero_end);
+        EXPECT_EQ(stripe_digest_, stripe_digest) << piece_size;
+        EXPECT_EQ(manifest_, manifest) << piece_size;
+        EXPECT_EQ(full_digest_, full_digest) << piece_size;
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(Sizes, ImageDigestTest,
+                         ::testing::Values(0, kManifestBlockSize, 5000, kDigestStripeSize,
+                                           kDigestStripeSize + 12345,
+                                           2 * kDigestStripeSize + kManifestBlockSize + 1));
+
+TEST(BlockManifest, Header) {
+    uint64_t size = 3 * kManifestBlockSize + 1;
+    std::string header = BlockManifestHeader(size);
+    ASSERT_EQ(header.size(), kBlockManifestHeaderSize);
+
+    uint32_t magic, block_size, hash_size;
+    uint64_t image_size, num_blocks;
+    memcpy(&magic, header.data(), sizeof(magic));
+    memcpy(&block_size, header.data() + 8, sizeof(block_size));
+    memcpy(&hash_size, header.data() + 12, sizeof(hash_size));
+    memcpy(&image_size, header.data() + 16, sizeof(image_size));
+    memcpy(&num_blocks, header.data() + 24, sizeof(num_blocks));
+    EXPECT_EQ(magic, kBlockManifestMagic);
+    EXPECT_EQ(block_size, kManifestBlockSize);
+    EXPECT_EQ(hash_size, kManifestHashSize);
+    EXPECT_EQ(image_size, size);
+    EXPECT_EQ(num_blocks, 4u);
+}
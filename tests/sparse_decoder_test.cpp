@@ -0,0 +1,194 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "sparse_decoder.h"
+#include "test_util.h"
+
+using namespace android::gsi;
+
+static constexpr uint32_t kBlockSize = 4096;
+static constexpr uint16_t kChunkRaw = 0xcac1;
+static constexpr uint16_t kChunkFill = 0xcac2;
+static constexpr uint16_t kChunkDontCare = 0xcac3;
+static constexpr uint16_t kChunkCrc32 = 0xcac4;
+
+static std::string MakeHeader(uint32_t total_blocks, uint32_t total_chunks) {
+    std::string header;
+    Append<uint32_t>(&header, 0xed26ff3a);
+    Append<uint16_t>(&header, 1);
+    Append<uint16_t>(&header, 0);
+    Append<uint16_t>(&header, kSparseHeaderSize);
+    Append<uint16_t>(&header, 12);
+    Append<uint32_t>(&header, kBlockSize);
+    Append<uint32_t>(&header, total_blocks);
+    Append<uint32_t>(&header, total_chunks);
+    Append<uint32_t>(&header, 0);
+    return header;
+}
+
+static std::string MakeChunk(uint16_t type, uint32_t blocks, uint32_t body_size) {
+    std::string chunk;
+    Append<uint16_t>(&chunk, type);
+    Append<uint16_t>(&chunk, 0);
+    Append<uint32_t>(&chunk, blocks);
+    Append<uint32_t>(&chunk, 12 + body_size);
+    return chunk;
+}
+
+// Decodes sparse images into image_, with don't-care blocks shown as 'x'.
+class SparseDecoderTest : public ::testing::Test {
+  protected:
+    bool Decode(const std::string& sparse, size_t chunk, bool* finished) {
+        image_.clear();
+        auto write = [this](const void* data, uint64_t bytes) -> bool {
+            image_.append(reinterpret_cast<const char*>(data), bytes);
+            return true;
+        };
+        auto fill = [this](uint32_t value, uint64_t bytes) -> bool {
+            for (uint64_t i = 0; i < bytes; i += sizeof(value)) {
+                Append<uint32_t>(&image_, value);
+            }
+            return true;
+        };
+        auto skip = [this](uint64_t bytes) -> bool {
+            image_.append(bytes, 'x');
+            return true;
+        };
+        SparseDecoder decoder(std::move(write), std::move(fill), std::move(skip));
+        auto decode = [&decoder](const char* data, size_t bytes) -> bool {
+            return decoder.Decode(data, bytes);
+        };
+        if (!FeedInPieces(sparse, chunk, decode)) {
+            return false;
+        }
+        *finished = decoder.finished();
+        return true;
+    }
+
+    std::string image_;
+};
+
+TEST(SparseHeader, IsSparse) {
+    auto header = MakeHeader(3, 0);
+    uint64_t image_size = 0;
+    EXPECT_TRUE(SparseDecoder::IsSparse(header.data(), header.size(), &image_size));
+    EXPECT_EQ(image_size, 3u * kBlockSize);
+    EXPECT_FALSE(SparseDecoder::IsSparse(header.data(), header.size() - 1));
+    header[0] ^= 1;
+    EXPECT_FALSE(SparseDecoder::IsSparse(header.data(), header.size()));
+}
+
+TEST_F(SparseDecoderTest, AllChunkTypes) {
+    std::string sparse = MakeHeader(4, 4);
+    sparse += MakeChunk(kChunkRaw, 1, kBlockSize);
+    sparse += std::string(kBlockSize, 'r');
+    sparse += MakeChunk(kChunkFill, 2, 4);
+    Append<uint32_t>(&sparse, 0x61616161);
+    sparse += MakeChunk(kChunkDontCare, 1, 0);
+    sparse += MakeChunk(kChunkCrc32, 0, 4);
+    Append<uint32_t>(&sparse, 0);
+
+    std::string expected = std::string(kBlockSize, 'r') + std::string(2 * kBlockSize, 'a') +
+                           std::string(kBlockSize, 'x');
+    // Split the input at every chunk boundary, and in the middle of headers.
+    for (size_t chunk : {static_cast<size_t>(1), static_cast<size_t>(5),
+                         static_cast<size_t>(12), static_cast<size_t>(kSparseHeaderSize),
+                         sparse.size()}) {
+        bool finished = false;
+        ASSERT_TRUE(Decode(sparse, chunk, &finished)) << chunk;
+        EXPECT_TRUE(finished) << chunk;
+        EXPECT_EQ(image_, expected) << chunk;
+    }
+}
+
+TEST_F(SparseDecoderTest, EmptyImage) {
+    bool finished = false;
+    ASSERT_TRUE(Decode(MakeHeader(0, 0), 1, &finished));
+    EXPECT_TRUE(finished);
+    EXPECT_TRUE(image_.empty());
+}
+
+TEST_F(SparseDecoderTest, NoChunks) {
+    bool finished;
+    EXPECT_FALSE(Decode(MakeHeader(1, 0), kSparseHeaderSize, &finished));
+}
+
+TEST_F(SparseDecoderTest, TruncatedChunk) {
+    std::string sparse = MakeHeader(1, 1);
+    sparse += MakeChunk(kChunkRaw, 1, kBlockSize);
+    sparse += std::string(kBlockSize - 1, 'r');
+    bool finished = true;
+    ASSERT_TRUE(Decode(sparse, 100, &finished));
+    EXPECT_FALSE(finished);
+}
+
+TEST_F(SparseDecoderTest, TruncatedChunkHeader) {
+    std::string sparse = MakeHeader(1, 1);
+    sparse += MakeChunk(kChunkDontCare, 1, 0).substr(0, 11);
+    bool finished = true;
+    ASSERT_TRUE(Decode(sparse, 3, &finished));
+    EXPECT_FALSE(finished);
+}
+
+TEST_F(SparseDecoderTest, ChunkSizeMismatch) {
+    std::string sparse = MakeHeader(1, 1);
+    sparse += MakeChunk(kChunkRaw, 1, kBlockSize - 4);
+    bool finished;
+    EXPECT_FALSE(Decode(sparse, sparse.size(), &finished));
+}
+
+TEST_F(SparseDecoderTest, ChunkTooSmall) {
+    std::string sparse = MakeHeader(1, 1);
+    Append<uint16_t>(&sparse, kChunkDontCare);
+    Append<uint16_t>(&sparse, 0);
+    Append<uint32_t>(&sparse, 1);
+    Append<uint32_t>(&sparse, 8);
+    bool finished;
+    EXPECT_FALSE(Decode(sparse, sparse.size(), &finished));
+}
+
+TEST_F(SparseDecoderTest, ChunksPastEnd) {
+    std::string sparse = MakeHeader(1, 1);
+    sparse += MakeChunk(kChunkDontCare, 2, 0);
+    bool finished;
+    EXPECT_FALSE(Decode(sparse, sparse.size(), &finished));
+}
+
+TEST_F(SparseDecoderTest, ChunksShortOfTotal) {
+    std::string sparse = MakeHeader(2, 1);
+    sparse += MakeChunk(kChunkDontCare, 1, 0);
+    bool finished;
+    EXPECT_FALSE(Decode(sparse, sparse.size(), &finished));
+}
+
+TEST_F(SparseDecoderTest, UnknownChunkType) {
+    std::string sparse = MakeHeader(1, 1);
+    sparse += MakeChunk(0xcac5, 1, 0);
+    bool finished;
+    EXPECT_FALSE(Decode(sparse, sparse.size(), &finished));
+}
+
+TEST_F(SparseDecoderTest, DataAfterEnd) {
+    std::string sparse = MakeHeader(1, 1);
+    sparse += MakeChunk(kChunkDontCare, 1, 0);
+    sparse += "x";
+    bool finished;
+    EXPECT_FALSE(Decode(sparse, sparse.size(), &finished));
+}
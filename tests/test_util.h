@@ -0,0 +1,47 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#pragma once
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+
+namespace android {
+namespace gsi {
+
+// Append |value| to |data| as raw bytes, as the on-disk formats store it.
+template <typename T>
+static inline void Append(std::string* data, T value) {
+    data->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Pass |data| to |consume| in pieces of |piece_size| bytes (the last may be
+// shorter), the way a stream would deliver it. Stops early if |consume|
+// returns false.
+static inline bool FeedInPieces(const std::string& data, size_t piece_size,
+                                const std::function<bool(const char*, size_t)>& consume) {
+    for (size_t pos = 0; pos < data.size(); pos += piece_size) {
+        if (!consume(data.data() + pos, std::min(piece_size, data.size() - pos))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android